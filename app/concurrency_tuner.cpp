@@ -0,0 +1,131 @@
+#include "concurrency_tuner.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <syslog.h>
+
+namespace {
+    // share of the linear scaling the throughput must follow: more workers must add at least this part
+    // of their relative count, less workers are kept while the throughput drops by less than it
+    const double SCALING_SHARE = 0.5;
+    // a step moves the count by this part of it, so the change of the throughput is measurable at large counts
+    const int STEP_DIVISOR = 8;
+    // steps without changes after turning back
+    const int HOLD_STEPS = 6;
+
+    // "$MAX $PERIOD" or "max $PERIOD", 0 - unlimited
+    double read_cpu_max(const std::string& filename)
+    {
+        std::ifstream ifs(filename.c_str());
+        std::string quota;
+        long long period = 0;
+        if (!(ifs >> quota >> period) || quota == "max" || period <= 0)
+            return 0;
+        return std::atoll(quota.c_str()) / (double)period;
+    }
+}
+
+ConcurrencyTuner::ConcurrencyTuner(std::shared_ptr<ThreadPool> workers, std::shared_ptr<IoBudget> budget)
+    : m_workers(workers)
+    , m_budget(budget)
+    , m_lastBytes(budget->Total())
+    , m_lastTime(clock::now())
+{
+}
+
+double ConcurrencyTuner::CpuLimit()
+{
+    // "0::/path" of the unified hierarchy, the limits of the ancestors apply too
+    std::ifstream cgroups("/proc/self/cgroup");
+    std::string line, path;
+    while (std::getline(cgroups, line)) {
+        if (line.compare(0, 3, "0::") == 0) {
+            path = line.substr(3);
+            break;
+        }
+    }
+
+    double limit = 0;
+    while (true) {
+        double cpus = read_cpu_max("/sys/fs/cgroup" + path + "/cpu.max");
+        if (cpus > 0 && (limit == 0 || cpus < limit))
+            limit = cpus;
+
+        const size_t pos = path.rfind('/');
+        if (path.empty() || pos == std::string::npos)
+            break;
+        path.erase(pos);
+    }
+    return limit;
+}
+
+void ConcurrencyTuner::Step()
+{
+    const uint64_t bytes = m_budget->Total();
+    const clock::time_point now = clock::now();
+    const double elapsed = std::chrono::duration<double>(now - m_lastTime).count();
+    const double rate = elapsed > 0 ? (bytes - m_lastBytes) / elapsed : 0;
+    m_lastBytes = bytes;
+    m_lastTime = now;
+
+    const int active = m_workers->Active();
+    // the tail of a scan or idle workers don't tell anything about the count
+    if (rate == 0 || m_workers->queueSize() < (size_t)active) {
+        m_lastRate = 0;
+        return;
+    }
+
+    if (m_hold > 0) {
+        // the held count is measured again, the next probe is compared to it
+        m_lastRate = rate;
+        m_lastActive = active;
+        if (--m_hold == 0) {
+            move(active, rate);
+        }
+        return;
+    }
+
+    if (m_lastRate == 0 || m_lastActive == active) {
+        m_lastRate = rate;
+        m_lastActive = active;
+        move(active, rate);
+        return;
+    }
+
+    const double change = (double)(active - m_lastActive) / m_lastActive;
+    const double gain = (rate - m_lastRate) / m_lastRate;
+    const double threshold = SCALING_SHARE * std::abs(change);
+    // more workers must pay off, less workers are kept while the throughput holds
+    const bool keep = change > 0 ? gain > threshold : gain >= -threshold;
+    if (keep) {
+        m_lastRate = rate;
+        m_lastActive = active;
+        move(active, rate);
+        return;
+    }
+
+    // the previous count is restored and held, the next probe continues in the same direction
+    const int previous = m_lastActive;
+    m_direction = previous > active ? 1 : -1;
+    m_hold = HOLD_STEPS;
+    m_lastRate = 0;
+    m_workers->Resize(previous);
+    syslog(LOG_INFO, "Worker threads: %d -> %d, %.1f MB/s didn't follow the count", active, previous, rate / (1024 * 1024));
+}
+
+void ConcurrencyTuner::move(int active, double rate)
+{
+    const int step = std::max(1, active / STEP_DIVISOR);
+    const int next = std::max(1, std::min(active + m_direction * step, m_workers->Capacity()));
+    if (next == active) {
+        // the bound is reached, the next probe goes the other way
+        m_direction = -m_direction;
+        m_hold = HOLD_STEPS;
+        return;
+    }
+    m_workers->Resize(next);
+    syslog(LOG_INFO, "Worker threads: %d -> %d at %.1f MB/s", active, next, rate / (1024 * 1024));
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "io_budget.h"
+#include "thread_pool.h"
+
+#include <chrono>
+#include <memory>
+
+// Hill climbing of the active workers on the measured read throughput.
+// A step is taken only while the scan keeps the workers busy. The count moves by about an eighth of it
+// in one direction while the throughput follows: up while it grows in proportion to the added workers,
+// down while it holds. Otherwise the previous count is restored and held for a few steps,
+// then the probe continues in the direction of the return.
+class ConcurrencyTuner
+{
+public:
+    ConcurrencyTuner(std::shared_ptr<ThreadPool> workers, std::shared_ptr<IoBudget> budget);
+
+    // one measurement and adjustment, called periodically
+    void Step();
+
+    // CPU limit of the process from cgroup v2 cpu.max, 0 - unlimited or unknown
+    static double CpuLimit();
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    std::shared_ptr<ThreadPool> m_workers;
+    std::shared_ptr<IoBudget> m_budget;
+
+    uint64_t m_lastBytes = 0;
+    clock::time_point m_lastTime;
+    // bytes/sec measured with the previous count, 0 - the next step probes without a comparison
+    double m_lastRate = 0;
+    // count the m_lastRate was measured with
+    int m_lastActive = 0;
+    int m_direction = 1;
+    int m_hold = 0;
+
+    // probes the next count in m_direction
+    void move(int active, double rate);
+};
@@ -0,0 +1,283 @@
+#include "control_server.h"
+
+#include "format.h"
+
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+namespace {
+    const uint64_t LISTEN_ID = 0;
+    const uint64_t EVENT_ID = UINT64_MAX;
+    const size_t MAX_REQUEST_SIZE = 64 * 1024;
+}
+
+
+ControlServer::ControlServer(const std::string& socketPath, handler_fn handler)
+    : m_socketPath(socketPath), m_handler(handler)
+{
+    sockaddr_un addr;
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (m_socketPath.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error(string::format("Socket path %s is too long", m_socketPath.c_str()));
+    }
+    strncpy(addr.sun_path, m_socketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+    m_listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_listenFd < 0) {
+        throw std::runtime_error(string::format("Cannot create socket: %s", strerror(errno)));
+    }
+
+    // stale socket of the previous run
+    unlink(m_socketPath.c_str());
+    if (bind(m_listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(m_listenFd, SOMAXCONN) != 0) {
+        std::string error = strerror(errno);
+        ::close(m_listenFd);
+        throw std::runtime_error(string::format("Cannot listen %s: %s", m_socketPath.c_str(), error.c_str()));
+    }
+
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    m_eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_epollFd < 0 || m_eventFd < 0) {
+        std::string error = strerror(errno);
+        ::close(m_listenFd);
+        if (m_epollFd >= 0)
+            ::close(m_epollFd);
+        if (m_eventFd >= 0)
+            ::close(m_eventFd);
+        throw std::runtime_error(string::format("Cannot create event loop: %s", error.c_str()));
+    }
+
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = LISTEN_ID;
+    epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_listenFd, &ev);
+    ev.data.u64 = EVENT_ID;
+    epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_eventFd, &ev);
+
+    m_thread = std::thread(&ControlServer::loop, this);
+}
+
+ControlServer::~ControlServer()
+{
+    Stop();
+
+    for (auto& [id, c] : m_clients) {
+        ::close(c.fd);
+    }
+    ::close(m_eventFd);
+    ::close(m_epollFd);
+    ::close(m_listenFd);
+    unlink(m_socketPath.c_str());
+}
+
+void ControlServer::Stop()
+{
+    if (!m_thread.joinable())
+        return;
+
+    m_stop = true;
+    uint64_t one = 1;
+    if (::write(m_eventFd, &one, sizeof(one)) < 0) {
+        syslog(LOG_ERR, "Cannot stop control server: %s", strerror(errno));
+    }
+    m_thread.join();
+}
+
+void ControlServer::loop()
+{
+    const int MAX_EVENTS = 64;
+    epoll_event events[MAX_EVENTS];
+
+    while (!m_stop) {
+        int n = epoll_wait(m_epollFd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Control server stopped: %s", strerror(errno));
+            return;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            uint64_t id = events[i].data.u64;
+            if (id == LISTEN_ID) {
+                accept();
+            }
+            else if (id == EVENT_ID) {
+                uint64_t counter;
+                while (::read(m_eventFd, &counter, sizeof(counter)) > 0) {}
+
+                std::vector<response> replies;
+                {
+                    std::lock_guard lock(m_mutex);
+                    replies.swap(m_replies);
+                }
+                for (auto& r : replies) {
+                    auto it = m_clients.find(r.id);
+                    // the client may be gone while the request was processed
+                    if (it == m_clients.end())
+                        continue;
+
+                    client& c = it->second;
+                    c.ready[r.seq] = std::move(r.text);
+                    for (auto ready = c.ready.begin(); ready != c.ready.end() && ready->first == c.nextResponse;
+                         ready = c.ready.erase(ready)) {
+                        c.out += ready->second;
+                        c.out += '\n';
+                        ++c.nextResponse;
+                    }
+                    write(r.id);
+                }
+            }
+            else {
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    close(id);
+                    continue;
+                }
+                if (events[i].events & EPOLLIN)
+                    read(id);
+                if (events[i].events & EPOLLOUT)
+                    write(id);
+            }
+        }
+    }
+}
+
+void ControlServer::accept()
+{
+    while (true) {
+        int fd = accept4(m_listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                syslog(LOG_ERR, "Control server accept failed: %s", strerror(errno));
+            return;
+        }
+
+        uint64_t id = m_nextId++;
+        m_clients[id].fd = fd;
+
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = id;
+        epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+void ControlServer::read(uint64_t id)
+{
+    auto it = m_clients.find(id);
+    if (it == m_clients.end())
+        return;
+    client& c = it->second;
+
+    char buf[4096];
+    while (true) {
+        ssize_t size = ::read(c.fd, buf, sizeof(buf));
+        if (size == 0) {
+            c.eof = true;
+            break;
+        }
+        if (size < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close(id);
+                return;
+            }
+            break;
+        }
+        c.in.append(buf, size);
+    }
+
+    size_t pos;
+    while ((pos = c.in.find('\n')) != std::string::npos) {
+        std::string request = c.in.substr(0, pos);
+        c.in.erase(0, pos + 1);
+        if (!request.empty() && request.back() == '\r')
+            request.pop_back();
+
+        uint64_t seq = c.nextRequest++;
+        m_handler(request, [this, id, seq](const std::string& response) { reply(id, seq, response); });
+    }
+
+    if (c.in.size() > MAX_REQUEST_SIZE) {
+        syslog(LOG_ERR, "Control server: too long request, closing the connection");
+        close(id);
+        return;
+    }
+    // the handler may reply synchronously, the reply is delivered by the next loop iteration
+    write(id);
+}
+
+void ControlServer::write(uint64_t id)
+{
+    auto it = m_clients.find(id);
+    if (it == m_clients.end())
+        return;
+    client& c = it->second;
+
+    while (!c.out.empty()) {
+        ssize_t size = ::write(c.fd, c.out.data(), c.out.size());
+        if (size < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close(id);
+                return;
+            }
+            break;
+        }
+        c.out.erase(0, size);
+    }
+
+    if (c.eof && c.nextResponse == c.nextRequest && c.out.empty()) {
+        close(id);
+        return;
+    }
+    update(id);
+}
+
+// waits for the writability only while there is something to write
+void ControlServer::update(uint64_t id)
+{
+    auto it = m_clients.find(id);
+    if (it == m_clients.end())
+        return;
+
+    epoll_event ev;
+    ev.events = (it->second.eof ? 0 : EPOLLIN) | (it->second.out.empty() ? 0 : EPOLLOUT);
+    ev.data.u64 = id;
+    epoll_ctl(m_epollFd, EPOLL_CTL_MOD, it->second.fd, &ev);
+}
+
+void ControlServer::close(uint64_t id)
+{
+    auto it = m_clients.find(id);
+    if (it == m_clients.end())
+        return;
+
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+    ::close(it->second.fd);
+    m_clients.erase(it);
+}
+
+// may be called from any thread
+void ControlServer::reply(uint64_t id, uint64_t seq, const std::string& text)
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_replies.push_back(response{ id, seq, text });
+    }
+    uint64_t one = 1;
+    if (::write(m_eventFd, &one, sizeof(one)) < 0) {
+        syslog(LOG_ERR, "Control server wakeup failed: %s", strerror(errno));
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Line based request/response server on a local unix socket, served by an epoll event loop.
+// The handler may reply asynchronously from any thread, so long requests don't block the loop.
+class ControlServer
+{
+public:
+
+    typedef std::function< void(const std::string& response) > reply_fn;
+    typedef std::function< void(const std::string& request, reply_fn reply) > handler_fn;
+
+    ControlServer(const std::string& socketPath, handler_fn handler);
+    ControlServer(const ControlServer&) = delete;
+    ControlServer operator=(const ControlServer&) = delete;
+    ~ControlServer();
+
+    // no more requests are read, the replies of the running ones are still accepted until the destruction
+    void Stop();
+
+private:
+
+    struct client {
+        int fd;
+        std::string in;
+        std::string out;
+        // the peer has finished sending, the connection is closed after the pending replies
+        bool eof = false;
+        // responses are delivered in the order of the requests
+        uint64_t nextRequest = 0;
+        uint64_t nextResponse = 0;
+        std::map<uint64_t, std::string> ready;
+    };
+
+    void loop();
+    void accept();
+    void read(uint64_t id);
+    void write(uint64_t id);
+    void close(uint64_t id);
+    void update(uint64_t id);
+    void reply(uint64_t id, uint64_t seq, const std::string& response);
+
+    const std::string m_socketPath;
+    handler_fn m_handler;
+    int m_listenFd = -1;
+    int m_epollFd = -1;
+    // wakes the loop up on the replies and the stop
+    int m_eventFd = -1;
+    std::atomic<bool> m_stop{ false };
+
+    // ids instead of fds, a reply must not go to a reused descriptor
+    uint64_t m_nextId = 1;
+    std::unordered_map<uint64_t, client> m_clients;
+
+    std::mutex m_mutex;
+    struct response {
+        uint64_t id;
+        uint64_t seq;
+        std::string text;
+    };
+    std::vector<response> m_replies;
+
+    std::thread m_thread;
+};
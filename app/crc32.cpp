@@ -1,4 +1,6 @@
 #include "crc32.h"
+#include "io_budget.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,6 +9,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <chrono>
 #include <stdexcept>
 
 #define BUFSIZE   16 * 1024
@@ -39,22 +42,94 @@ unsigned int crc32(unsigned int crc,unsigned char *buffer, unsigned int size)
     return i ^ 0xffffffff;
 }
  
-void calc_crc(const char *in_file, unsigned int *file_crc)
+void calc_crc(const char *in_file, unsigned int *file_crc, IoBudget *budget, unsigned long long *size)
+{
+    crc_request request;
+    crc_result result;
+
+    calc_crc_range(in_file, &request, &result, budget);
+
+    *file_crc = result.crc;
+    if (size) {
+        *size = result.size;
+    }
+}
+
+void calc_crc_range(const char *in_file, const crc_request *request, crc_result *result, IoBudget *budget)
 {
     int fd;
-    int nread;
+    int nread = 0;
     unsigned char buf[BUFSIZE];
-    unsigned int crc = 0;
- 
-    fd = open(in_file, O_RDONLY);
+    unsigned int crc = request->prefix_crc;
+    unsigned long long pos = request->offset;
+    std::chrono::steady_clock::duration readTime{ 0 }, crcTime{ 0 };
+    std::chrono::steady_clock::time_point t0, t1;
+
+    trace::Scope scope("calc_crc");
+    {
+        TRACE_SCOPE("open");
+        fd = open(in_file, O_RDONLY);
+    }
     if (fd < 0) {
         throw std::runtime_error( std::string("open failed: ") + strerror(errno) );
     }
- 
-    while ((nread = read(fd, buf, BUFSIZE)) > 0) {
+    if (pos && lseek(fd, pos, SEEK_SET) < 0) {
+        int err = errno;
+        close(fd);
+        throw std::runtime_error( std::string("seek failed: ") + strerror(err) );
+    }
+
+    result->checkpoints.clear();
+    result->probed = false;
+    if (request->probe && request->probe == pos) {
+        result->probed = true;
+        result->probe_crc = crc;
+    }
+
+    // per block phases are timed only for the sampled files, the totals go to the event details
+    const bool timed = scope.Recorded();
+    while (!request->end || pos < request->end) {
+        // reads are split at the checkpoints and the probe
+        unsigned long long stop = pos + BUFSIZE;
+        if (request->end && request->end < stop)
+            stop = request->end;
+        if (request->block_size && (pos / request->block_size + 1) * request->block_size < stop)
+            stop = (pos / request->block_size + 1) * request->block_size;
+        if (request->probe > pos && request->probe < stop)
+            stop = request->probe;
+
+        if (timed)
+            t0 = std::chrono::steady_clock::now();
+        nread = read(fd, buf, stop - pos);
+        if (timed)
+            t1 = std::chrono::steady_clock::now();
+        if (nread <= 0)
+            break;
+
         crc = crc32(crc, buf, nread);
+        pos += nread;
+        if (timed) {
+            readTime += t1 - t0;
+            crcTime += std::chrono::steady_clock::now() - t1;
+        }
+        if (budget) {
+            budget->Consume(nread);
+        }
+
+        if (request->block_size && pos % request->block_size == 0) {
+            result->checkpoints.push_back(crc);
+        }
+        if (request->probe == pos) {
+            result->probed = true;
+            result->probe_crc = crc;
+        }
     }
-    *file_crc = crc;
+    result->crc = crc;
+    result->size = pos;
+
+    scope.Arg("bytes", pos - request->offset);
+    scope.Arg("read_us", std::chrono::duration_cast<std::chrono::microseconds>(readTime).count());
+    scope.Arg("crc_us", std::chrono::duration_cast<std::chrono::microseconds>(crcTime).count());
  
     close(fd);
  
@@ -63,3 +138,58 @@ void calc_crc(const char *in_file, unsigned int *file_crc)
     }
 
 }
+
+// GF(2) matrix operators of appending zero bits to the CRC register, as in zlib
+static unsigned int gf2_matrix_times(const unsigned int *mat, unsigned int vec)
+{
+    unsigned int sum = 0;
+    while (vec) {
+        if (vec & 1)
+            sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(unsigned int *square, const unsigned int *mat)
+{
+    for (int n = 0; n < 32; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+unsigned int crc32_combine(unsigned int crc1, unsigned int crc2, unsigned long long len2)
+{
+    unsigned int even[32], odd[32];
+
+    if (len2 == 0)
+        return crc1;
+
+    // operator for one zero bit
+    odd[0] = 0xedb88320;
+    unsigned int row = 1;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    gf2_matrix_square(even, odd); // two zero bits
+    gf2_matrix_square(odd, even); // four zero bits
+
+    // apply len2 zero bytes to crc1
+    do {
+        gf2_matrix_square(even, odd);
+        if (len2 & 1)
+            crc1 = gf2_matrix_times(even, crc1);
+        len2 >>= 1;
+        if (len2 == 0)
+            break;
+
+        gf2_matrix_square(odd, even);
+        if (len2 & 1)
+            crc1 = gf2_matrix_times(odd, crc1);
+        len2 >>= 1;
+    } while (len2 != 0);
+
+    return crc1 ^ crc2;
+}
@@ -1,4 +1,36 @@
 #pragma once
 
+#include <vector>
+
+class IoBudget;
+
+// part of a file to hash
+struct crc_request {
+    // start of the hashing, must be a multiple of block_size
+    unsigned long long offset = 0;
+    // CRC of [0, offset)
+    unsigned int prefix_crc = 0;
+    // 0 - up to the end of the file
+    unsigned long long end = 0;
+    // prefix CRCs are recorded at every block_size boundary, 0 - no checkpoints
+    unsigned long long block_size = 0;
+    // the prefix CRC at this offset is recorded too, 0 - no probe
+    unsigned long long probe = 0;
+};
+
+struct crc_result {
+    // CRC of [0, size)
+    unsigned int crc = 0;
+    unsigned long long size = 0;
+    bool probed = false;
+    unsigned int probe_crc = 0;
+    // CRCs of [0, k * block_size) for each boundary after offset
+    std::vector<unsigned int> checkpoints;
+};
+
 void init_crc_table(void);
-void calc_crc(const char *in_file, unsigned int *crc);
+// size is set to the number of bytes read if not null
+void calc_crc(const char *in_file, unsigned int *crc, IoBudget *budget = nullptr, unsigned long long *size = nullptr);
+void calc_crc_range(const char *in_file, const crc_request *request, crc_result *result, IoBudget *budget = nullptr);
+// CRC of the concatenation from CRCs of the parts, len2 is the length of the second part
+unsigned int crc32_combine(unsigned int crc1, unsigned int crc2, unsigned long long len2);
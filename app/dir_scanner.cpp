@@ -2,17 +2,58 @@
 
 #include "crc32.h"
 #include "defer.h"
+#include "file_layout.h"
 #include "format.h"
+#include "hash.h"
+#include "periodic_task.h"
+#include "trace.h"
 
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <sys/stat.h>
 #include <syslog.h>
 
 namespace fs = std::filesystem;
 
+namespace {
+    // files are sorted and submitted by batches to keep memory bounded on large trees
+    const size_t SCAN_BATCH_SIZE = 8192;
+    // seconds between the baseline progress reports
+    const int BASELINE_REPORT_PERIOD = 10;
+    // distance between the prefix CRC checkpoints
+    const uint64_t CHECKPOINT_BLOCK = 64ULL * 1024 * 1024;
+    // the rest of the changed ranges is omitted in the messages
+    const size_t MAX_REPORTED_RANGES = 8;
+    // pause before the next attempt to submit into the full shared queue
+    const auto QUEUE_RETRY_DELAY = std::chrono::milliseconds(10);
 
-DirScanner::DirScanner(const std::string& dir, int threadsCount, int threadQeueSize)
-    : m_directory(dir)
+    std::atomic<int> g_nextOwner{ 1 };
+
+    // absolute path without the trailing separator, the same form as the scanned paths
+    fs::path normalize(const fs::path& path)
+    {
+        fs::path result = fs::absolute(path).lexically_normal();
+        if (!result.has_filename() && result.has_relative_path()) {
+            result = result.parent_path();
+        }
+        return result;
+    }
+}
+
+
+DirScanner::DirScanner(const std::string& dir, std::shared_ptr<ThreadPool> workers, std::shared_ptr<Watcher> watcher,
+                       std::shared_ptr<IoBudget> budget, int queueLimit)
+    : m_directory(normalize(dir))
+    , m_workerTreads(workers)
+    , m_watcher(watcher)
+    , m_budget(std::make_shared<IoBudget>(budget))
+    , m_owner(g_nextOwner++)
+    , m_queueLimit(std::max(1, queueLimit))
+    , m_etalonTree(m_directory)
+    , m_resultTree(m_directory)
 {
     if (!fs::exists(m_directory)) {
         throw std::runtime_error(string::format("\"%s\" not exists", m_directory.c_str()));
@@ -21,131 +62,972 @@ DirScanner::DirScanner(const std::string& dir, int threadsCount, int threadQeueS
         throw std::runtime_error(string::format("\"%s\" is not a directory", m_directory.c_str()));
     }
 
-    m_workerTreads.reset(new ThreadPool(threadsCount, threadQeueSize));
     init_crc_table();
 
     // init Watcher
     auto callback_fn = [this](const std::string& path)
     {
+        // the event goes ahead of the bulk scan work, the latency from the event to the verdict is reported
+        auto start = std::chrono::steady_clock::now();
         m_waitGroup.Add();
-        if (!m_workerTreads->addTask( std::bind(&DirScanner::calculateCrc, this, path, true) )) {
+        auto task = [this, path, start]()
+        {
+            Defer doOnScopeExit(
+                [this]() { m_waitGroup.Done(); } );
+            calculateCrc(links{ path }, true, true);
+            auto latency = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+            syslog(LOG_INFO, "Verdict for %s in %lld ms", path.c_str(), (long long)latency.count());
+        };
+        if (!m_workerTreads->addTask(task, ThreadPoolQueue::INTERACTIVE, m_owner)) {
             m_waitGroup.Done();
             syslog(LOG_ERR, "ThreadPool queue is full");
             std::cerr << "ThreadPool queue is full\n";
         }
     };
-    SetCallback(callback_fn);
-    // TODO: callback for statuses NEW and ABSENT
-    AddWatch(dir);
+    m_watchCallback = callback_fn;
+    m_watchExclude = [this](const std::string& path, bool isDir)
+    {
+        if (excluded(path, isDir, nullptr)) {
+            return true;
+        }
+        struct stat st;
+        if (isDir || stat(path.c_str(), &st) != 0) {
+            if (!isDir) {
+                // the removed file isn't admitted later
+                std::lock_guard lock(m_deferredMutex);
+                m_deferred.erase(path);
+            }
+            return false;
+        }
+        if (!excludedFile(path, st)) {
+            return false;
+        }
+        // e.g. a file younger than --min_age, its events are gone once it's old enough, so the scan admits it
+        std::lock_guard lock(m_deferredMutex);
+        m_deferred.insert(path);
+        return true;
+    };
+    // TODO: callback for status NEW
+    m_watcher->AddWatch(m_directory, m_watchCallback, m_watchExclude);
+}
+
+DirScanner::~DirScanner()
+{
+    // the shared watcher and workers outlive the directory, nothing of it may stay in them
+    m_watcher->RemoveWatches(m_directory);
+    Cancel();
+    if (m_baselineThread.joinable()) {
+        m_baselineThread.join();
+    }
+    m_waitGroup.Wait();
+}
+
+void DirScanner::WatchTree()
+{
+    m_watcher->AddWatch(m_directory, m_watchCallback, m_watchExclude);
+    // only the directories are watched here, the files are counted by the baseline thread
+    for (auto it = fs::recursive_directory_iterator(m_directory); it != fs::end(it); ++it) {
+        const auto& entry = *it;
+        std::error_code ec;
+        if (!entry.is_directory(ec)) {
+            continue;
+        }
+        if (excluded(entry.path(), true, nullptr)) {
+            it.disable_recursion_pending();
+            continue;
+        }
+        m_watcher->AddWatch(entry.path(), m_watchCallback, m_watchExclude);
+    }
+}
+
+void DirScanner::countBaseline()
+{
+    m_baseline.totalFiles = m_baseline.doneFiles = 0;
+    m_baseline.totalBytes = m_baseline.doneBytes = 0;
+    // only the metadata is read, the total is used for the baseline ETA
+    for (auto it = fs::recursive_directory_iterator(m_directory); it != fs::end(it) && !m_cancel.load(); ++it) {
+        const auto& entry = *it;
+        std::error_code ec;
+        if (entry.is_directory(ec)) {
+            if (excluded(entry.path(), true, nullptr)) {
+                it.disable_recursion_pending();
+            }
+        }
+        else if (entry.is_regular_file(ec)) {
+            struct stat st;
+            if (stat(entry.path().c_str(), &st) != 0 || excluded(entry.path(), false, &st)) {
+                continue;
+            }
+            ++m_baseline.totalFiles;
+            m_baseline.totalBytes += st.st_size;
+        }
+    }
+}
+
+void DirScanner::StartBaseline()
+{
+    m_baseline.running = true;
+    m_baseline.complete = false;
+    m_baseline.start = std::chrono::steady_clock::now();
+
+    m_baselineThread = std::thread([this]()
+    {
+        PeriodicTask report(BASELINE_REPORT_PERIOD, [this]() { syslog(LOG_INFO, "%s", Progress().c_str()); });
+        buildBaseline(ThreadPoolQueue::BACKGROUND);
+    });
+}
+
+void DirScanner::buildBaseline(ThreadPoolQueue::priority prio)
+{
+    bool cancelled = false;
+    countBaseline();
+    scan(true, 0, 1, prio, &cancelled);
+    m_baseline.complete = !cancelled;
+    {
+        // a cancel after the scan is over has nothing to stop
+        std::lock_guard lock(m_cancelMutex);
+        m_baseline.running = false;
+        if (m_scans == 0) {
+            m_cancel.store(false);
+        }
+    }
+    if (cancelled) {
+        syslog(LOG_WARNING, "Baseline of %s is cancelled, the next scan resumes it", m_directory.c_str());
+        return;
+    }
+    syslog(LOG_INFO, "Baseline of %s is built in %lld s", m_directory.c_str(),
+        (long long)std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - m_baseline.start).count());
+}
+
+bool DirScanner::resumeBaseline(ThreadPoolQueue::priority prio)
+{
+    if (m_baseline.running) {
+        syslog(LOG_INFO, "Scan of %s is skipped, the baseline is in progress", m_directory.c_str());
+        return true;
+    }
+    if (m_baseline.complete) {
+        return false;
+    }
+
+    // the files without the etalon aren't reported as new, they are added as by the baseline
+    syslog(LOG_INFO, "Baseline of %s is resumed", m_directory.c_str());
+    m_baseline.running = true;
+    buildBaseline(prio);
+    return true;
+}
+
+uint64_t DirScanner::ReadBytes() const
+{
+    return m_budget->Total();
+}
+
+std::string DirScanner::Progress(time_t nextScan)
+{
+    const size_t doneFiles = m_baseline.doneFiles, totalFiles = std::max(m_baseline.totalFiles.load(), doneFiles);
+    const uint64_t doneBytes = m_baseline.doneBytes, totalBytes = std::max(m_baseline.totalBytes.load(), doneBytes);
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_baseline.start).count();
+
+    // the rate of the baseline so far, -1 if unknown
+    long long eta = -1;
+    if (!m_baseline.running) {
+        eta = 0;
+    }
+    else if (doneBytes && elapsed > 0) {
+        eta = (long long)((totalBytes - doneBytes) / (doneBytes / elapsed));
+    }
+
+    return string::format(
+        "{ \"directory\": \"%s\", \"baseline\": \"%s\", \"files\": %zu, \"total_files\": %zu, \"bytes\": %llu, \"total_bytes\": %llu, \"eta_s\": %lld, \"next_scan\": %lld}",
+        string::escape_json(m_directory).c_str(), m_baseline.running ? "RUNNING" : (m_baseline.complete ? "DONE" : "INCOMPLETE"),
+        doneFiles, totalFiles,
+        (unsigned long long)doneBytes, (unsigned long long)totalBytes, eta, (long long)nextScan);
 }
 
 void DirScanner::Scan(bool save) 
 {
+    if (resumeBaseline(ThreadPoolQueue::PERIODIC)) {
+        return;
+    }
+
+    if (scan(save, 0, 1, ThreadPoolQueue::PERIODIC)) {
+        syslog(LOG_INFO, "Integrity check: OK");
+    }
+
+    auto stats = m_workerTreads->queueStats(ThreadPoolQueue::INTERACTIVE);
+    if (stats.count) {
+        syslog(LOG_INFO, "Interactive queue wait: avg %lld us, max %lld us",
+            (long long)(stats.total_wait.count() / stats.count), (long long)stats.max_wait.count());
+    }
+
+    // equal root digests confirm the whole tree is unchanged
+    uint64_t etalonDigest = m_etalonTree.RootDigest();
+    uint64_t resultDigest = m_resultTree.RootDigest();
+    syslog(resultDigest == etalonDigest ? LOG_INFO : LOG_ERR, "Root digest of %s: etalon %016llx, actual %016llx",
+        m_directory.c_str(), (unsigned long long)etalonDigest, (unsigned long long)resultDigest);
+}
+
+void DirScanner::SetShards(size_t shardsCount)
+{
+    m_shardsCount = std::max((size_t)1, shardsCount);
+    m_nextShard = 0;
+}
+
+void DirScanner::ScanNextShard()
+{
+    if (resumeBaseline(ThreadPoolQueue::BACKGROUND)) {
+        return;
+    }
+
+    if (m_nextShard == 0) {
+        m_cycleStart = time(nullptr);
+    }
+
+    const size_t shard = m_nextShard;
+    bool cancelled = false;
+    if (scan(false, shard, m_shardsCount, ThreadPoolQueue::BACKGROUND, &cancelled)) {
+        syslog(LOG_INFO, "Integrity check: OK (shard %zu/%zu)", shard + 1, m_shardsCount);
+    }
+    if (cancelled) {
+        // the cycle must cover every shard, the cancelled one is retried by the next period
+        syslog(LOG_INFO, "Shard %zu/%zu of %s is retried by the next period", shard + 1, m_shardsCount, m_directory.c_str());
+        return;
+    }
+
+    m_nextShard = (m_nextShard + 1) % m_shardsCount;
+    if (m_nextShard != 0) {
+        return;
+    }
+
+    // the whole tree was covered, report the oldest verification to detect the skipped files
+    ++m_coverageCycle;
+    time_t oldest = 0;
+    {
+        std::shared_lock lock(m_mutex);
+        for (const auto& [path, info]: m_fileCrcMap) {
+            if (!oldest || info.last_verified < oldest) {
+                oldest = info.last_verified;
+            }
+        }
+    }
+    syslog(LOG_INFO, "Coverage cycle %zu completed in %ld s, oldest verification %ld s ago",
+        m_coverageCycle, (long)(time(nullptr) - m_cycleStart), oldest ? (long)(time(nullptr) - oldest) : 0L);
+}
+
+void DirScanner::SetReadOrder(read_order order)
+{
+    m_readOrder = order;
+}
+
+void DirScanner::SetAppendOnly(bool appendOnly)
+{
+    m_appendOnly = appendOnly;
+}
+
+void DirScanner::SetFilter(const PathFilter& filter)
+{
+    m_filter = filter;
+}
+
+bool DirScanner::excluded(const fs::path& path, bool isDir, const struct stat* st)
+{
+    if (m_filter.Empty()) {
+        return false;
+    }
+
+    // the rules are relative to the root
+    const std::string& full = path.native();
+    const std::string& root = m_directory.native();
+    size_t pos = 0;
+    if (full.compare(0, root.size(), root) == 0) {
+        pos = root.size();
+        while (pos < full.size() && full[pos] == '/') {
+            ++pos;
+        }
+    }
+    if (m_filter.Excluded(full.substr(pos), isDir)) {
+        return true;
+    }
+    return !isDir && st && excludedFile(path, *st);
+}
+
+bool DirScanner::excludedFile(const fs::path& path, const struct stat& st)
+{
+    if (!m_filter.ExcludedFile(st)) {
+        return false;
+    }
+    // the size and age only keep the files out of the etalon, a tracked file is verified whatever it becomes
+    std::shared_lock lock(m_mutex);
+    return m_fileCrcMap.find(path) == m_fileCrcMap.end();
+}
+
+bool DirScanner::scan(bool save, size_t shard, size_t shardsCount, ThreadPoolQueue::priority prio, bool* cancelled)
+{
+    TRACE_SCOPE("scan");
+    const time_t scanStart = time(nullptr);
     m_ok.store(true);
+    {
+        std::lock_guard lock(m_cancelMutex);
+        ++m_scans;
+    }
+
+    {
+        TRACE_SCOPE("scan.enumerate");
+        std::vector<scan_entry> batch;
+        batch.reserve(SCAN_BATCH_SIZE);
+        // files with several hardlinks are hashed at the end of the scan, once per (dev, inode)
+        std::map<std::pair<dev_t, ino_t>, links> hardlinks;
 
-    for (const auto& entry : fs::recursive_directory_iterator(m_directory)) {
-        if (!entry.is_regular_file()) {
-            // another rule of directory watching?
-            if (entry.is_directory() && save) {
-                AddWatch(entry.path());
+        for (auto it = fs::recursive_directory_iterator(m_directory); it != fs::end(it); ++it) {
+            const auto& entry = *it;
+            if (m_cancel.load()) {
+                break;
+            }
+            if (!entry.is_regular_file()) {
+                if (entry.is_directory() && excluded(entry.path(), true, nullptr)) {
+                    // the whole subtree is skipped without reading it
+                    it.disable_recursion_pending();
+                    continue;
+                }
+                // another rule of directory watching?
+                if (entry.is_directory() && save) {
+                    m_watcher->AddWatch(entry.path(), m_watchCallback, m_watchExclude);
+                }
+                continue;
+            }
+            if (excluded(entry.path(), false, nullptr)) {
+                continue;
+            }
+
+            // the path hash is stable, so each file always falls into the same shard
+            if (shardsCount > 1 && hash::fnv1a(entry.path().native()) % shardsCount != shard) {
+                continue;
+            }
+
+            struct stat st;
+            if (stat(entry.path().c_str(), &st) != 0) {
+                // calculateCrc reports the error
+                st.st_dev = 0;
+                st.st_ino = 0;
+                st.st_nlink = 1;
+            }
+            else if (excludedFile(entry.path(), st)) {
+                continue;
+            }
+            // the file dropped by the watcher passes the limits now, it's added to the etalon by any scan
+            bool admit = false;
+            {
+                std::lock_guard lock(m_deferredMutex);
+                admit = m_deferred.erase(entry.path()) > 0;
+            }
+
+            if (st.st_nlink > 1) {
+                hardlinks[{ st.st_dev, st.st_ino }].push_back(entry.path());
+                continue;
+            }
+
+            batch.push_back({ entry.path(), st.st_dev, st.st_ino, 0, admit });
+            if (batch.size() >= SCAN_BATCH_SIZE) {
+                submitBatch(batch, save, prio);
             }
-            continue;
         }
+        submitBatch(batch, save, prio);
 
-        m_waitGroup.Add();
-        if (!m_workerTreads->addTask( std::bind(&DirScanner::calculateCrc, this, entry.path(), save) )) {
-            m_waitGroup.Done();
-            syslog(LOG_ERR, "ThreadPool queue is full");
-            std::cerr << "ThreadPool queue is full\n";
+        // std::map is already ordered by (dev, inode)
+        for (const auto& [id, filenames] : hardlinks) {
+            submit(filenames, save, prio);
         }
     }
 
-    m_waitGroup.Wait();
-    if (m_ok.load()) {
-        syslog(LOG_INFO, "Integrity check: OK");
+    {
+        TRACE_SCOPE("scan.wait");
+        m_waitGroup.Wait();
+    }
+    // a cancel of the starting baseline applies to this scan too, the flag is cleared by the last running scan
+    bool wasCancelled;
+    {
+        std::lock_guard lock(m_cancelMutex);
+        wasCancelled = m_cancel.load();
+        if (--m_scans == 0) {
+            m_cancel.store(false);
+        }
+    }
+    if (wasCancelled) {
+        if (cancelled) {
+            *cancelled = true;
+        }
+        syslog(LOG_WARNING, "Integrity check: CANCELLED");
+        return false;
     }
+    // the tracked files which weren't reached by the scan
+    checkAbsent(scanStart, shard, shardsCount);
+    return m_ok.load();
 }
 
-// TODO: mapstruct, marshall or smth; remove last ','
+void DirScanner::submitBatch(std::vector<scan_entry>& batch, bool save, ThreadPoolQueue::priority prio)
+{
+    switch (m_readOrder) {
+        case read_order::EXTENT:
+            for (auto& entry : batch) {
+                entry.offset = first_physical_offset(entry.path.c_str());
+            }
+            std::sort(batch.begin(), batch.end(), [](const scan_entry& lhs, const scan_entry& rhs) {
+                return std::tie(lhs.dev, lhs.offset, lhs.ino) < std::tie(rhs.dev, rhs.offset, rhs.ino);
+            });
+            break;
+        case read_order::INODE:
+            std::sort(batch.begin(), batch.end(), [](const scan_entry& lhs, const scan_entry& rhs) {
+                return std::tie(lhs.dev, lhs.ino) < std::tie(rhs.dev, rhs.ino);
+            });
+            break;
+        default:
+            break;
+    }
+
+    for (const auto& entry : batch) {
+        submit(links{ entry.path }, save || entry.admit, prio);
+    }
+    batch.clear();
+}
+
+void DirScanner::submit(const links& filenames, bool save, ThreadPoolQueue::priority prio)
+{
+    auto task = [this, filenames, save]()
+    {
+        // the failure is stored before Done(), so the scan can't return its verdict without it
+        Defer doOnScopeExit(
+            [this]() { m_waitGroup.Done(); } );
+        {
+            std::lock_guard lock(m_queuedMutex);
+            --m_queued;
+        }
+        m_queuedCond.notify_one();
+
+        if (m_cancel.load()) {
+            return;
+        }
+        if (!calculateCrc(filenames, save).empty()) {
+            m_ok.store(false);
+        }
+    };
+
+    // backpressure, a large root must not take the whole shared queue
+    {
+        std::unique_lock lock(m_queuedMutex);
+        m_queuedCond.wait(lock, [this]() { return m_queued < m_queueLimit; });
+        ++m_queued;
+    }
+
+    m_waitGroup.Add();
+    // the lane is shared with the other roots, the file waits for the room instead of being dropped
+    while (!m_workerTreads->addTask(task, prio, m_owner)) {
+        if (m_cancel.load()) {
+            {
+                std::lock_guard lock(m_queuedMutex);
+                --m_queued;
+            }
+            m_waitGroup.Done();
+            return;
+        }
+        std::this_thread::sleep_for(QUEUE_RETRY_DELAY);
+    }
+}
+
+// TODO: mapstruct, marshall or smth
 void DirScanner::Save(const std::string& filename) {
     std::ofstream ofs(filename.c_str());
     if (!ofs.good()) {
         throw std::runtime_error(string::format("Unable to open %s", filename.c_str()));
     }
-    auto get_status = [](const file_status& s)
-    {
-        switch(s) {
-            case file_status::OK:
-                return "OK";
-            case file_status::FAIL:
-                return "FAIL";
-            case file_status::NEW:
-                return "NEW";
-            case file_status::ABSENT:
-                return "ABSENT";
+    std::shared_lock lock(m_mutex);
+    const char* separator = "\n";
+    ofs << "[";
+    for (const auto& [path, info]: m_fileCrcMap) {
+        ofs << separator << string::format(
+            "{ \"path\": \"%s\", \"etalon_crc32\": \"0X%08X\", \"result_crc32\": \"0X%08X\", \"status\": \"%s\", \"last_verified\": %ld, \"size\": %llu}",
+            string::escape_json(path).c_str(), info.etalon_crc32, info.result_crc32, statusName(info.status), (long)info.last_verified,
+            (unsigned long long)info.trusted.size );
+        separator = ",\n";
+    }
+    // the empty tree is a valid empty array too
+    ofs << "\n]";
+}
+
+void DirScanner::SaveChanged(const std::string& filename) {
+    std::ofstream ofs(filename.c_str());
+    if (!ofs.good()) {
+        throw std::runtime_error(string::format("Unable to open %s", filename.c_str()));
+    }
+    ofs << Changed();
+}
+
+const char* DirScanner::statusName(file_status status)
+{
+    switch(status) {
+        case file_status::OK:
+            return "OK";
+        case file_status::FAIL:
+            return "FAIL";
+        case file_status::NEW:
+            return "NEW";
+        case file_status::ABSENT:
+            return "ABSENT";
+        case file_status::CHANGED_BEFORE_BASELINE:
+            return "CHANGED_BEFORE_BASELINE";
+        case file_status::APPENDED:
+            return "APPENDED";
+        default:
+            return "UNKNOWN";
+    }
+}
+
+std::string DirScanner::Changed()
+{
+    auto get_change = [](const MerkleTree::change_type& c)
+    {
+        switch(c) {
+            case MerkleTree::change_type::ADDED:
+                return "ADDED";
+            case MerkleTree::change_type::REMOVED:
+                return "REMOVED";
+            case MerkleTree::change_type::CHANGED:
+                return "CHANGED";
             default:
                 return "UNKNOWN";
         }
     };
 
+    auto changes = m_etalonTree.Diff(m_resultTree);
+
     std::shared_lock lock(m_mutex);
-    size_t filesNumber = m_fileCrcMap.size();
-    size_t counter = 0;
-    ofs << "[\n";
-    for (const auto& [path, info]: m_fileCrcMap) {
-        if (++counter != filesNumber) {
-            ofs << string::format(
-                "{ \"path\": \"%s\", \"etalon_crc32\": \"0X%08X\", \"result_crc32\": \"0X%08X\", \"status\": \"%s\"},\n",
-                path.c_str(), info.etalon_crc32, info.result_crc32, get_status(info.status) );
+    std::string result = "[";
+    for (size_t i = 0; i < changes.size(); ++i) {
+        const auto& [path, change] = changes[i];
+        auto it = m_fileCrcMap.find(path);
+        result += string::format(
+            "%s\n{ \"path\": \"%s\", \"etalon_crc32\": \"0X%08X\", \"result_crc32\": \"0X%08X\", \"change\": \"%s\"}",
+            i ? "," : "", string::escape_json(path).c_str(),
+            it != m_fileCrcMap.end() ? it->second.etalon_crc32 : 0,
+            it != m_fileCrcMap.end() ? it->second.result_crc32 : 0,
+            get_change(change) );
+    }
+    result += "\n]";
+    return result;
+}
+
+std::string DirScanner::Status(const std::string& path)
+{
+    fs::path filename = normalize(path);
+
+    std::error_code ec;
+    if (fs::is_directory(filename, ec)) {
+        // equal digests confirm the whole subtree is unchanged
+        const uint64_t etalonDigest = m_etalonTree.Digest(filename);
+        const uint64_t resultDigest = m_resultTree.Digest(filename);
+        return string::format("{ \"path\": \"%s\", \"etalon_digest\": \"%016llx\", \"result_digest\": \"%016llx\", \"status\": \"%s\"}",
+            string::escape_json(filename).c_str(), (unsigned long long)etalonDigest, (unsigned long long)resultDigest,
+            etalonDigest == resultDigest ? "OK" : "CHANGED");
+    }
+
+    std::shared_lock lock(m_mutex);
+    auto it = m_fileCrcMap.find(filename);
+    if (it == m_fileCrcMap.end()) {
+        return string::format("{ \"path\": \"%s\", \"error\": \"unknown file\"}", string::escape_json(filename).c_str());
+    }
+    const file_info& info = it->second;
+    return string::format(
+        "{ \"path\": \"%s\", \"etalon_crc32\": \"0X%08X\", \"result_crc32\": \"0X%08X\", \"status\": \"%s\", \"last_verified\": %ld}",
+        string::escape_json(filename).c_str(), info.etalon_crc32, info.result_crc32, statusName(info.status), (long)info.last_verified );
+}
+
+bool DirScanner::markAbsent(const fs::path& filename)
+{
+    std::error_code ec;
+    if (fs::exists(filename, ec) || ec) {
+        return false;
+    }
+
+    {
+        std::unique_lock lock(m_mutex);
+        auto it = m_fileCrcMap.find(filename);
+        if (it == m_fileCrcMap.end()) {
+            return false;
+        }
+        it->second.status = file_status::ABSENT;
+        it->second.result_crc32 = 0;
+        it->second.last_verified = time(nullptr);
+    }
+    m_resultTree.Remove(filename);
+    return true;
+}
+
+void DirScanner::checkAbsent(time_t scanStart, size_t shard, size_t shardsCount)
+{
+    links candidates;
+    {
+        std::shared_lock lock(m_mutex);
+        for (const auto& [path, info]: m_fileCrcMap) {
+            if (info.status != file_status::ABSENT && info.last_verified < scanStart
+                && (shardsCount == 1 || hash::fnv1a(path.native()) % shardsCount == shard)) {
+                candidates.push_back(path);
+            }
         }
-        else { // last entry
-            ofs << string::format(
-                "{ \"path\": \"%s\", \"etalon_crc32\": \"0X%08X\", \"result_crc32\": \"0X%08X\", \"status\": \"%s\"}\n]",
-                path.c_str(), info.etalon_crc32, info.result_crc32, get_status(info.status) );
+    }
+
+    for (const auto& filename : candidates) {
+        if (markAbsent(filename)) {
+            m_ok.store(false);
+            syslog(LOG_ERR, "Integrity check: FAIL (%s - the file was removed)", filename.c_str());
         }
     }
 }
 
+void DirScanner::Cancel()
+{
+    std::lock_guard lock(m_cancelMutex);
+    if (m_scans > 0 || m_baseline.running) {
+        m_cancel.store(true);
+    }
+}
+
+void DirScanner::Verify(const std::string& path, reply_fn reply)
+{
+    struct request {
+        std::mutex mutex;
+        size_t files = 0;
+        failures failed;
+        std::atomic<size_t> remaining{ 0 };
+        reply_fn reply;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    auto respond = [](request& req)
+    {
+        auto latency = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - req.start);
+        std::string failed;
+        for (size_t i = 0; i < req.failed.size(); ++i) {
+            failed += string::format("%s{ \"path\": \"%s\", \"error\": \"%s\"}", i ? ", " : "",
+                string::escape_json(req.failed[i].first).c_str(), string::escape_json(req.failed[i].second).c_str());
+        }
+        req.reply(string::format("{ \"status\": \"%s\", \"files\": %zu, \"time_ms\": %lld, \"failed\": [%s]}",
+            req.failed.empty() ? "OK" : "FAIL", req.files, (long long)latency.count(), failed.c_str()));
+    };
+
+    auto req = std::make_shared<request>();
+    req->reply = reply;
+    req->start = std::chrono::steady_clock::now();
+
+    // a subtree is enumerated by a worker, so the control socket isn't blocked by it
+    auto enumerate = [this, path, req, respond]()
+    {
+        Defer doOnScopeExit(
+            [this]() { m_waitGroup.Done(); } );
+
+        links filenames;
+        try {
+            fs::path root = normalize(path);
+            if (fs::is_directory(root)) {
+                for (auto it = fs::recursive_directory_iterator(root); it != fs::end(it); ++it) {
+                    if (it->is_directory() && excluded(it->path(), true, nullptr)) {
+                        it.disable_recursion_pending();
+                    }
+                    else if (it->is_regular_file() && !excluded(it->path(), false, nullptr)) {
+                        filenames.push_back(it->path());
+                    }
+                }
+            }
+            else {
+                filenames.push_back(root);
+            }
+        }
+        catch (const std::exception& e) {
+            req->failed.emplace_back(path, e.what());
+            respond(*req);
+            return;
+        }
+
+        req->files = filenames.size();
+        // the guard keeps the request open until all the tasks are submitted
+        req->remaining = filenames.size() + 1;
+        auto finish = [req, respond]()
+        {
+            if (--req->remaining == 0) {
+                respond(*req);
+            }
+        };
+
+        // the failures are reported to the client only, the verdict of a running scan isn't affected
+        for (const auto& filename : filenames) {
+            auto task = [this, filename, req, finish]()
+            {
+                Defer doOnScopeExit(
+                    [this]() { m_waitGroup.Done(); } );
+                auto failed = calculateCrc(links{ filename }, false);
+                if (!failed.empty()) {
+                    std::lock_guard lock(req->mutex);
+                    req->failed.insert(req->failed.end(), failed.begin(), failed.end());
+                }
+                finish();
+            };
+
+            m_waitGroup.Add();
+            if (!m_workerTreads->addTask(task, ThreadPoolQueue::INTERACTIVE, m_owner)) {
+                m_waitGroup.Done();
+                std::lock_guard lock(req->mutex);
+                req->failed.emplace_back(filename, "ThreadPool queue is full");
+                finish();
+            }
+        }
+        finish();
+    };
+
+    m_waitGroup.Add();
+    if (!m_workerTreads->addTask(enumerate, ThreadPoolQueue::INTERACTIVE, m_owner)) {
+        m_waitGroup.Done();
+        req->failed.emplace_back(path, "ThreadPool queue is full");
+        respond(*req);
+    }
+}
+
 
 // TODO separate read and write?
-void DirScanner::calculateCrc(const fs::path& filename, bool save) 
+DirScanner::failures DirScanner::calculateCrc(const links& filenames, bool save, bool event) 
 {
-    Defer doOnScopeExit(
-        [this]() { m_waitGroup.Done(); } );
+    TRACE_SCOPE("calculateCrc");
 
+    failures failed;
+    verdict result;
+    // failed files are counted as done too
+    Defer countProgress(
+        [this, &filenames, &result, event]() {
+            if (m_baseline.running && !event) {
+                m_baseline.doneFiles += filenames.size();
+                m_baseline.doneBytes += result.actual.size;
+            }
+        } );
     try {
+        result = hashContent(filenames.front());
+        // std::cout << string::format("%08x\t%s\n", result.actual.crc, filename.c_str());
+    }
+    catch (const std::exception& e) {
+        for (const auto& filename : filenames) {
+            std::error_code ec;
+            if (markAbsent(filename)) {
+                syslog(LOG_ERR, "Integrity check: FAIL (%s - the file was removed)", filename.c_str());
+                failed.emplace_back(filename, "the file was removed");
+                continue;
+            }
+            if (event && !fs::exists(filename, ec) && !ec) {
+                // an untracked file is gone before its event was handled, e.g. a temporary one
+                continue;
+            }
+            syslog(LOG_ERR, "Integrity check: FAIL (%s - %s)", filename.c_str(), e.what());
+            failed.emplace_back(filename, e.what());
+        }
+        return failed;
+    }
+
+    for (const auto& filename : filenames) {
+        std::string error = updateCrc(filename, result, save, event);
+        if (!error.empty()) {
+            failed.emplace_back(filename, error);
+        }
+    }
+    return failed;
+}
+
+DirScanner::verdict DirScanner::hashContent(const fs::path& filename)
+{
+    verdict result;
+    content trusted;
+    bool known = false;
+    {
+        std::shared_lock lock(m_mutex);
+        auto it = m_fileCrcMap.find(filename);
+        if (it != m_fileCrcMap.end()) {
+            trusted = it->second.trusted;
+            known = true;
+        }
+    }
+
+    struct stat st;
+    if (known && stat(filename.c_str(), &st) == 0 && (uint64_t)st.st_size > trusted.size) {
+        if (hashTail(filename, trusted, result.actual)) {
+            result.appended = true;
+            return result;
+        }
+    }
+
+    crc_request request;
+    request.block_size = CHECKPOINT_BLOCK;
+    crc_result crc;
+    calc_crc_range(filename.c_str(), &request, &crc, m_budget.get());
+
+    result.actual.crc = crc.crc;
+    result.actual.size = crc.size;
+    result.actual.checkpoints.assign(crc.checkpoints.begin(), crc.checkpoints.end());
+    if (known && (result.actual.crc != trusted.crc || result.actual.size != trusted.size)) {
+        result.ranges = changedRanges(trusted, result.actual);
+    }
+    return result;
+}
+
+bool DirScanner::hashTail(const fs::path& filename, const content& trusted, content& actual)
+{
+    const size_t k = std::min(trusted.checkpoints.size(), (size_t)(trusted.size / CHECKPOINT_BLOCK));
+
+    // the tail from the last checkpoint, the prefix CRC at the trusted size must match
+    crc_request request;
+    request.offset = k * CHECKPOINT_BLOCK;
+    request.prefix_crc = k ? trusted.checkpoints[k - 1] : 0;
+    request.block_size = CHECKPOINT_BLOCK;
+    request.probe = trusted.size;
+    crc_result tail;
+    calc_crc_range(filename.c_str(), &request, &tail, m_budget.get());
+    if (trusted.size && (!tail.probed || tail.probe_crc != trusted.crc)) {
+        return false;
+    }
+
+    // the checkpointed blocks aren't read, one of them is re-verified per check
+    if (k) {
+        const size_t block = m_prefixCheck++ % k;
+        crc_request blockRequest;
+        blockRequest.offset = block * CHECKPOINT_BLOCK;
+        blockRequest.prefix_crc = block ? trusted.checkpoints[block - 1] : 0;
+        blockRequest.end = (block + 1) * CHECKPOINT_BLOCK;
+        crc_result blockCrc;
+        calc_crc_range(filename.c_str(), &blockRequest, &blockCrc, m_budget.get());
+        if (blockCrc.crc != trusted.checkpoints[block]) {
+            return false;
+        }
+    }
+
+    actual.crc = tail.crc;
+    actual.size = tail.size;
+    actual.checkpoints.assign(trusted.checkpoints.begin(), trusted.checkpoints.begin() + k);
+    actual.checkpoints.insert(actual.checkpoints.end(), tail.checkpoints.begin(), tail.checkpoints.end());
+    return true;
+}
+
+std::string DirScanner::changedRanges(const content& lhs, const content& rhs)
+{
+    // the CRC of a single block is restored from the neighbouring prefix CRCs
+    auto block_crc = [](const std::vector<uint32_t>& checkpoints, size_t block)
+    {
+        return checkpoints[block] ^ crc32_combine(block ? checkpoints[block - 1] : 0, 0, CHECKPOINT_BLOCK);
+    };
+
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    auto add_range = [&ranges](uint64_t begin, uint64_t end)
+    {
+        if (!ranges.empty() && ranges.back().second == begin)
+            ranges.back().second = end;
+        else
+            ranges.emplace_back(begin, end);
+    };
+
+    const size_t common = std::min(lhs.checkpoints.size(), rhs.checkpoints.size());
+    for (size_t block = 0; block < common; ++block) {
+        if (block_crc(lhs.checkpoints, block) != block_crc(rhs.checkpoints, block)) {
+            add_range(block * CHECKPOINT_BLOCK, (block + 1) * CHECKPOINT_BLOCK);
+        }
+    }
+
+    // the tails after the last checkpoint are comparable only if they have the same length
+    const uint64_t tailBegin = common * CHECKPOINT_BLOCK;
+    bool tailChanged = lhs.size != rhs.size || lhs.checkpoints.size() != rhs.checkpoints.size();
+    if (!tailChanged) {
+        const uint32_t prefix = common ? lhs.checkpoints[common - 1] : 0;
+        const uint32_t rhsPrefix = common ? rhs.checkpoints[common - 1] : 0;
+        tailChanged = (lhs.crc ^ crc32_combine(prefix, 0, lhs.size - tailBegin))
+                      != (rhs.crc ^ crc32_combine(rhsPrefix, 0, rhs.size - tailBegin));
+    }
+    if (tailChanged) {
+        add_range(tailBegin, std::max(lhs.size, rhs.size));
+    }
+
+    std::string result;
+    for (size_t i = 0; i < ranges.size() && i < MAX_REPORTED_RANGES; ++i) {
+        result += string::format("%s[%llu, %llu)", i ? ", " : "",
+            (unsigned long long)ranges[i].first, (unsigned long long)ranges[i].second);
+    }
+    if (ranges.size() > MAX_REPORTED_RANGES) {
+        result += ", ...";
+    }
+    return result;
+}
+
+std::string DirScanner::updateCrc(const fs::path& filename, const verdict& result, bool save, bool event)
+{
+    const uint32_t crc = result.actual.crc;
+    try {
+        // a new file is in the actual tree too, so Changed() reports it as ADDED
+        m_resultTree.Update(filename, crc);
+
+        // the lookup and the insert are atomic, so the baseline can't overwrite the verdict of a watcher event
+        std::unique_lock lock(m_mutex);
         std::unordered_map<fs::path, file_info>::iterator it;
-        {
+        bool inserted = false;
+        if (save) {
             // TODO: equal_range for hash collision
-            std::shared_lock lock(m_mutex);
+            std::tie(it, inserted) = m_fileCrcMap.try_emplace(filename, crc);
+        }
+        else {
             it = m_fileCrcMap.find(filename);
             if (it == m_fileCrcMap.end()) {
-                if (!save) {
-                    throw std::runtime_error("new file");
-                }
+                throw std::runtime_error("new file");
             }
         }
 
-        uint32_t crc;
-        calc_crc(filename.c_str(), &crc);
-        // std::cout << string::format("%08x\t%s\n", crc, filename.c_str());
-
-        if (it != m_fileCrcMap.end()) {
-            it->second.result_crc32 = crc;
-            if (crc != it->second.etalon_crc32) {
-                it->second.status = file_status::FAIL;
-                throw std::runtime_error(
-                    string::format("CRC mismatch: expected %08x  actual %08x", it->second.etalon_crc32, crc) );
+        file_info& info = it->second;
+        if (inserted) {
+            // the result is valid whenever last_verified is set, the comparison of the exports relies on it
+            info.result_crc32 = crc;
+            info.last_verified = time(nullptr);
+            info.trusted = result.actual;
+            if (m_baseline.running && event) {
+                // the watcher got ahead of the baseline, the original content is unknown
+                info.status = file_status::CHANGED_BEFORE_BASELINE;
+                syslog(LOG_WARNING, "Integrity check: %s was changed before its baseline", filename.c_str());
             }
+            m_etalonTree.Update(filename, crc);
+            return std::string();
         }
-        else if (save) {
-            std::unique_lock lock(m_mutex);
-            file_info info(crc);
-            m_fileCrcMap[filename] = info;
+
+        if (m_baseline.running && save && !event && info.status == file_status::CHANGED_BEFORE_BASELINE) {
+            // the baseline may have read the content before the change, the event is newer
+            return std::string();
+        }
+
+        info.result_crc32 = crc;
+        info.last_verified = time(nullptr);
+        if (crc == info.trusted.crc && result.actual.size == info.trusted.size) {
+            return std::string();
+        }
+
+        if (result.appended && m_appendOnly) {
+            syslog(LOG_NOTICE, "Integrity check: APPENDED (%s - %llu -> %llu bytes, the prefix is intact)", filename.c_str(),
+                (unsigned long long)info.trusted.size, (unsigned long long)result.actual.size);
+            // the grown content becomes the etalon, so the digests, CHANGED and Save() agree with it
+            info.status = file_status::APPENDED;
+            info.trusted = result.actual;
+            info.etalon_crc32 = crc;
+            m_etalonTree.Update(filename, crc);
+            return std::string();
+        }
+
+        info.status = file_status::FAIL;
+        if (result.appended) {
+            throw std::runtime_error(
+                string::format("CRC mismatch: expected %08x  actual %08x, the file grew from %llu to %llu bytes, the prefix is intact",
+                    info.trusted.crc, crc, (unsigned long long)info.trusted.size, (unsigned long long)result.actual.size) );
         }
+        throw std::runtime_error(
+            string::format("CRC mismatch: expected %08x  actual %08x%s%s", info.trusted.crc, crc,
+                result.ranges.empty() ? "" : ", changed bytes ", result.ranges.c_str()) );
     }
     catch (const std::exception& e) {
-        m_ok.store(false);
         syslog(LOG_ERR, "Integrity check: FAIL (%s - %s)", filename.c_str(), e.what());
+        return e.what();
     }
+    return std::string();
 }
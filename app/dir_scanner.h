@@ -1,23 +1,75 @@
 #pragma once
 
+#include "io_budget.h"
+#include "merkle_tree.h"
+#include "path_filter.h"
 #include "thread_pool.h"
 #include "waitgroup.h"
 #include "watcher.h"
 
-#include <cstring>
+#include <chrono>
+#include <condition_variable>
 #include <filesystem>
 #include <shared_mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
 #include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
 
 
-class DirScanner : public Watcher {
+// One monitored root. The worker pool, the inotify descriptor and the read budget may be shared by several roots.
+class DirScanner {
 
 public:
 
-    DirScanner(const std::string& dir, int threadsCount, int threadQeueSize);
+    enum read_order {
+        DIRECTORY = 0, // recursive_directory_iterator order
+        INODE,
+        EXTENT         // first physical extent from FIEMAP, inode when unavailable
+    };
+
+    // queueLimit bounds the scan tasks queued by this root, the scan waits for the room
+    DirScanner(const std::string& dir, std::shared_ptr<ThreadPool> workers, std::shared_ptr<Watcher> watcher,
+               std::shared_ptr<IoBudget> budget, int queueLimit);
+
+    ~DirScanner();
+
+    const std::filesystem::path& Directory() const { return m_directory; }
+
+    // immediate start: the watches are added before the baseline, then the baseline is built in the background,
+    // the scans are skipped until it's done
+    void WatchTree();
+    void StartBaseline();
+    // nextScan - planned start of the periodic scan, 0 - not scheduled
+    std::string Progress(time_t nextScan = 0);
+    // bytes read by the scans and the checks of this directory
+    uint64_t ReadBytes() const;
 
     void Scan(bool save=false);
+    // rolling mode: verifies one of the shards per call, so the whole tree is covered once per SetShards() calls
+    void ScanNextShard();
+    void SetShards(size_t shardsCount);
+    void SetReadOrder(read_order order);
+    // grown files with the intact prefix are accepted, the appended content becomes trusted
+    void SetAppendOnly(bool appendOnly);
+    // excluded directories are pruned from the scans and not watched, events of the excluded files are dropped,
+    // must be set before the first scan
+    void SetFilter(const PathFilter& filter);
     void Save(const std::string& filename);
+    // exports only the entries which differ from the etalon, the cost is proportional to the changes
+    void SaveChanged(const std::string& filename);
+
+    // control API, the responses are single line JSON
+    typedef std::function<void(const std::string& response)> reply_fn;
+    // verifies the file or the whole subtree ahead of the scan work, reply is called from a worker thread
+    void Verify(const std::string& path, reply_fn reply);
+    // a directory is reported by its etalon and actual digests
+    std::string Status(const std::string& path);
+    std::string Changed();
+    // the queued files of the running scans are skipped, an idle directory ignores it
+    void Cancel();
 
 private:
 
@@ -25,30 +77,143 @@ private:
         OK = 0,
         FAIL,
         NEW,
-        ABSENT
+        ABSENT,
+        // modified before the baseline was calculated, the etalon is the modified content
+        CHANGED_BEFORE_BASELINE,
+        // append-only file has grown with the intact prefix
+        APPENDED
+    };
+
+    // hashed content of a file, prefix CRCs are kept at every CHECKPOINT_BLOCK boundary,
+    // so a grown file is hashed from the last checkpoint and a mismatch is narrowed to the blocks
+    struct content {
+        uint32_t crc = 0;
+        uint64_t size = 0;
+        std::vector<uint32_t> checkpoints;
     };
 
     typedef struct file_info_t {
-        uint32_t etalon_crc32;
-        uint32_t result_crc32;
-        file_status status;
+        uint32_t etalon_crc32 = 0;
+        uint32_t result_crc32 = 0;
+        file_status status = file_status::OK;
+        time_t last_verified = 0;
+        // the next check is compared to it: the etalon or the last appended content of an append-only file
+        content trusted;
 
-        file_info_t() {
-            memset(this, 0x00, sizeof(*this));
-        }
+        file_info_t() = default;
         file_info_t(uint32_t crc) : file_info_t() {
             etalon_crc32 = crc;
         }
     } file_info;
 
-    // ATTENTION: m_waitGroup.Add() must be called before this function to synchronize output status
-    void calculateCrc(const std::filesystem::path& filename, bool save);
+    // result of the hashing compared to the trusted content
+    struct verdict {
+        content actual;
+        // the file has grown and its trusted prefix is intact
+        bool appended = false;
+        // changed byte ranges
+        std::string ranges;
+    };
+
+    static const char* statusName(file_status status);
+
+    // a regular file found by the scan
+    struct scan_entry {
+        std::filesystem::path path;
+        dev_t dev;
+        ino_t ino;
+        uint64_t offset;
+        // deferred by the watcher, the file is added to the etalon
+        bool admit = false;
+    };
+
+    // hardlinks share the content, so the checksum is calculated once and applied to every link
+    typedef std::vector<std::filesystem::path> links;
+    // path and error message
+    typedef std::vector<std::pair<std::filesystem::path, std::string>> failures;
+
+    // st is used for the size and age predicates of the files, may be null
+    bool excluded(const std::filesystem::path& path, bool isDir, const struct stat* st);
+    // the size and age predicates, they apply only to the files which aren't tracked yet
+    bool excludedFile(const std::filesystem::path& path, const struct stat& st);
+
+    void submit(const links& filenames, bool save, ThreadPoolQueue::priority prio);
+    // sorts the batch by the physical layout and submits it
+    void submitBatch(std::vector<scan_entry>& batch, bool save, ThreadPoolQueue::priority prio);
+
+    // checksum of the file compared to its trusted content, only the tail of a grown file is read
+    verdict hashContent(const std::filesystem::path& filename);
+    // hashes only the grown tail, false if the trusted prefix was modified
+    bool hashTail(const std::filesystem::path& filename, const content& trusted, content& actual);
+    static std::string changedRanges(const content& lhs, const content& rhs);
+
+    // ATTENTION: m_waitGroup.Add() must be called before this function and Done() after its result is recorded
+    // to synchronize output status
+    // event is set for the watcher events
+    failures calculateCrc(const links& filenames, bool save, bool event = false);
+    // empty string if the checksum is OK
+    std::string updateCrc(const std::filesystem::path& filename, const verdict& result, bool save, bool event);
+    // a tracked file which doesn't exist becomes ABSENT and leaves the actual tree, false otherwise
+    bool markAbsent(const std::filesystem::path& filename);
+    // the tracked files of the shard which weren't verified since scanStart
+    void checkAbsent(time_t scanStart, size_t shard, size_t shardsCount);
+    // shardsCount == 1 means the full scan, cancelled is set if the scan was cancelled
+    bool scan(bool save, size_t shard, size_t shardsCount, ThreadPoolQueue::priority prio, bool* cancelled = nullptr);
+    // totals of the baseline ETA, a metadata walk of the tree
+    void countBaseline();
+    void buildBaseline(ThreadPoolQueue::priority prio);
+    // true if the scan must be skipped: the baseline is running or the cancelled one was resumed instead
+    bool resumeBaseline(ThreadPoolQueue::priority prio);
 
     const std::filesystem::path m_directory;
-    std::unique_ptr<ThreadPool> m_workerTreads;
+    std::shared_ptr<ThreadPool> m_workerTreads;
+    std::shared_ptr<Watcher> m_watcher;
+    Watcher::callback_fn m_watchCallback;
+    std::shared_ptr<IoBudget> m_budget;
+    // owner of the tasks in the shared queue
+    const int m_owner;
+    const int m_queueLimit;
+    std::mutex m_queuedMutex;
+    std::condition_variable m_queuedCond;
+    int m_queued = 0;
     std::shared_mutex m_mutex;
     std::unordered_map<std::filesystem::path, file_info> m_fileCrcMap;
+    // directory digests of the etalon and of the last calculated checksums
+    MerkleTree m_etalonTree;
+    MerkleTree m_resultTree;
     // ATTENTION: possible deadlock or race condition, Done() MUST be called for each Add()
     WaitGroup m_waitGroup;
     std::atomic<bool> m_ok;
+    std::atomic<bool> m_cancel{ false };
+    // the cancel is accepted only while a scan or the baseline runs, so it can't carry over to a later scan
+    std::mutex m_cancelMutex;
+    int m_scans = 0;
+    read_order m_readOrder = read_order::INODE;
+    bool m_appendOnly = false;
+    PathFilter m_filter;
+    Watcher::exclude_fn m_watchExclude;
+    // untracked files whose events were dropped by the size and age limits
+    std::mutex m_deferredMutex;
+    std::unordered_set<std::filesystem::path> m_deferred;
+    // rolling index of the prefix block re-verified by the tail hashing
+    std::atomic<size_t> m_prefixCheck{ 0 };
+
+    struct baseline_progress {
+        std::atomic<bool> running{ false };
+        // false while the baseline isn't built, a cancelled one stays incomplete
+        std::atomic<bool> complete{ true };
+        std::atomic<size_t> totalFiles{ 0 };
+        std::atomic<size_t> doneFiles{ 0 };
+        std::atomic<uint64_t> totalBytes{ 0 };
+        std::atomic<uint64_t> doneBytes{ 0 };
+        std::chrono::steady_clock::time_point start;
+    };
+    baseline_progress m_baseline;
+    std::thread m_baselineThread;
+
+    // rolling verification state, used only by ScanNextShard()
+    size_t m_shardsCount = 1;
+    size_t m_nextShard = 0;
+    size_t m_coverageCycle = 0;
+    time_t m_cycleStart = 0;
 };
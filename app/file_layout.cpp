@@ -0,0 +1,33 @@
+#include "file_layout.h"
+
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+uint64_t first_physical_offset(const char *in_file)
+{
+    // fiemap ends with a flexible array, room for one extent is enough
+    alignas(struct fiemap) char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    struct fiemap *map = (struct fiemap *)buf;
+    uint64_t offset = 0;
+
+    int fd = open(in_file, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    memset(buf, 0x00, sizeof(buf));
+    map->fm_start = 0;
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0) {
+        offset = map->fm_extents[0].fe_physical;
+    }
+
+    close(fd);
+    return offset;
+}
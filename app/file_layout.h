@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdint.h>
+
+// Physical offset of the first file extent reported by FIEMAP,
+// 0 if the file is empty or the filesystem doesn't support FIEMAP
+uint64_t first_physical_offset(const char *in_file);
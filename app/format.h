@@ -22,4 +22,24 @@ inline std::string format(const std::string fmt, ...) {
     return str;
 }
 
+// escapes a string for a JSON string literal
+inline std::string escape_json(const std::string& str) {
+    std::string escaped;
+    escaped.reserve(str.size());
+    for (unsigned char c : str) {
+        switch (c) {
+            case '"':  escaped += "\\\""; break;
+            case '\\': escaped += "\\\\"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\t': escaped += "\\t"; break;
+            default:
+                if (c < 0x20)
+                    escaped += format("\\u%04x", c);
+                else
+                    escaped += c;
+        }
+    }
+    return escaped;
+}
+
 }
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+
+namespace hash
+{
+
+// FNV-1a 64 bit, stable between runs and hosts unlike std::hash
+const uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+const uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t seed = FNV_OFFSET) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    uint64_t h = seed;
+    while (size--) {
+        h ^= *p++;
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+inline uint64_t fnv1a(const std::string& str, uint64_t seed = FNV_OFFSET) {
+    return fnv1a(str.data(), str.size(), seed);
+}
+
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+
+// Read bandwidth shared by all the monitored roots
+class IoBudget
+{
+public:
+    // bytes per second, 0 - unlimited
+    explicit IoBudget(uint64_t rate = 0) : m_rate(rate) {}
+    // own byte counter of a root, the bandwidth is limited by the shared parent
+    explicit IoBudget(std::shared_ptr<IoBudget> parent) : m_rate(0), m_parent(parent) {}
+
+    // blocks the reader while the budget is exceeded
+    void Consume(size_t bytes) {
+        m_total += bytes;
+        if (m_parent) {
+            m_parent->Consume(bytes);
+            return;
+        }
+        if (!m_rate)
+            return;
+
+        clock::time_point wakeup;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            // unused budget is accumulated for one second at most
+            m_next = std::max(m_next, clock::now() - std::chrono::seconds(1));
+            m_next += std::chrono::nanoseconds(bytes * 1000000000ULL / m_rate);
+            wakeup = m_next;
+        }
+        std::this_thread::sleep_until(wakeup);
+    }
+
+    // bytes read since the start
+    uint64_t Total() const { return m_total.load(); }
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    const uint64_t m_rate;
+    const std::shared_ptr<IoBudget> m_parent;
+    std::atomic<uint64_t> m_total{ 0 };
+    std::mutex m_mutex;
+    clock::time_point m_next;
+};
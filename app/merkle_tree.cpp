@@ -0,0 +1,180 @@
+#include "merkle_tree.h"
+
+#include "hash.h"
+
+namespace fs = std::filesystem;
+
+
+MerkleTree::MerkleTree(const fs::path& root)
+    : m_root(root.lexically_normal())
+{
+}
+
+std::vector<std::string> MerkleTree::split(const fs::path& path) const
+{
+    std::vector<std::string> parts;
+    for (const auto& part : path.lexically_normal().lexically_relative(m_root)) {
+        // trailing separator gives an empty element
+        if (!part.empty() && part != ".") {
+            parts.push_back(part.native());
+        }
+    }
+    return parts;
+}
+
+void MerkleTree::Update(const fs::path& filename, uint32_t crc)
+{
+    auto parts = split(filename);
+    if (parts.empty()) {
+        return;
+    }
+
+    std::lock_guard lock(m_mutex);
+    node* n = &m_rootNode;
+    for (const auto& part : parts) {
+        n->dirty = true;
+        auto& child = n->children[part];
+        if (!child) {
+            child.reset(new node);
+        }
+        n = child.get();
+    }
+    n->is_file = true;
+    n->crc = crc;
+    n->dirty = true;
+}
+
+void MerkleTree::Remove(const fs::path& filename)
+{
+    auto parts = split(filename);
+    if (parts.empty()) {
+        return;
+    }
+
+    std::lock_guard lock(m_mutex);
+    std::vector<node*> trail{ &m_rootNode };
+    for (const auto& part : parts) {
+        auto it = trail.back()->children.find(part);
+        if (it == trail.back()->children.end()) {
+            return;
+        }
+        trail.push_back(it->second.get());
+    }
+
+    // drop the file and the directories left empty
+    for (size_t i = parts.size(); i > 0; --i) {
+        node* parent = trail[i - 1];
+        if (trail[i]->children.empty()) {
+            parent->children.erase(parts[i - 1]);
+        }
+        parent->dirty = true;
+    }
+}
+
+uint64_t MerkleTree::RootDigest()
+{
+    std::lock_guard lock(m_mutex);
+    return digest(&m_rootNode);
+}
+
+uint64_t MerkleTree::Digest(const fs::path& dir)
+{
+    auto parts = split(dir);
+
+    std::lock_guard lock(m_mutex);
+    node* n = &m_rootNode;
+    for (const auto& part : parts) {
+        auto it = n->children.find(part);
+        if (it == n->children.end()) {
+            return 0;
+        }
+        n = it->second.get();
+    }
+    return digest(n);
+}
+
+// must be called under m_mutex
+uint64_t MerkleTree::digest(node* n)
+{
+    if (!n->dirty) {
+        return n->digest;
+    }
+
+    if (n->is_file) {
+        n->digest = hash::fnv1a(&n->crc, sizeof(n->crc));
+    }
+    else {
+        // std::map keeps children sorted, so the digest doesn't depend on the insertion order
+        uint64_t h = hash::FNV_OFFSET;
+        for (const auto& [name, child] : n->children) {
+            h = hash::fnv1a(name.c_str(), name.size() + 1, h);
+            uint64_t childDigest = digest(child.get());
+            h = hash::fnv1a(&childDigest, sizeof(childDigest), h);
+        }
+        n->digest = h;
+    }
+    n->dirty = false;
+    return n->digest;
+}
+
+std::vector<MerkleTree::change> MerkleTree::Diff(MerkleTree& other)
+{
+    std::vector<change> changes;
+    if (&other == this) {
+        return changes;
+    }
+
+    std::scoped_lock lock(m_mutex, other.m_mutex);
+    diff(&m_rootNode, &other.m_rootNode, m_root, changes);
+    return changes;
+}
+
+// must be called under both mutexes
+void MerkleTree::diff(node* lhs, node* rhs, const fs::path& path, std::vector<change>& changes)
+{
+    if (digest(lhs) == digest(rhs)) {
+        return;
+    }
+
+    if (lhs->is_file || rhs->is_file) {
+        if (lhs->is_file && rhs->is_file) {
+            changes.emplace_back(path, change_type::CHANGED);
+        }
+        else {
+            // a file was replaced by a directory or vice versa
+            collect(lhs, path, change_type::REMOVED, changes);
+            collect(rhs, path, change_type::ADDED, changes);
+        }
+        return;
+    }
+
+    // merge of the sorted children
+    auto lit = lhs->children.begin();
+    auto rit = rhs->children.begin();
+    while (lit != lhs->children.end() || rit != rhs->children.end()) {
+        if (rit == rhs->children.end() || (lit != lhs->children.end() && lit->first < rit->first)) {
+            collect(lit->second.get(), path / lit->first, change_type::REMOVED, changes);
+            ++lit;
+        }
+        else if (lit == lhs->children.end() || rit->first < lit->first) {
+            collect(rit->second.get(), path / rit->first, change_type::ADDED, changes);
+            ++rit;
+        }
+        else {
+            diff(lit->second.get(), rit->second.get(), path / lit->first, changes);
+            ++lit;
+            ++rit;
+        }
+    }
+}
+
+void MerkleTree::collect(node* n, const fs::path& path, change_type type, std::vector<change>& changes)
+{
+    if (n->is_file) {
+        changes.emplace_back(path, type);
+        return;
+    }
+    for (const auto& [name, child] : n->children) {
+        collect(child.get(), path / name, type, changes);
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+// Directory digests aggregated from the children names and checksums.
+// Updates only mark the path to the root as dirty, digests are recalculated lazily on demand.
+class MerkleTree
+{
+public:
+
+    enum change_type {
+        ADDED = 0,
+        REMOVED,
+        CHANGED
+    };
+
+    typedef std::pair<std::filesystem::path, change_type> change;
+
+    explicit MerkleTree(const std::filesystem::path& root);
+    MerkleTree(const MerkleTree&) = delete;
+    MerkleTree operator=(const MerkleTree&) = delete;
+
+    void Update(const std::filesystem::path& filename, uint32_t crc);
+    void Remove(const std::filesystem::path& filename);
+
+    uint64_t RootDigest();
+    // 0 if the directory is unknown
+    uint64_t Digest(const std::filesystem::path& dir);
+
+    // files of the other tree compared to this one, only directories with different digests are visited
+    std::vector<change> Diff(MerkleTree& other);
+
+private:
+
+    struct node {
+        std::map<std::string, std::unique_ptr<node>> children;
+        bool is_file = false;
+        bool dirty = true;
+        uint32_t crc = 0;
+        uint64_t digest = 0;
+    };
+
+    std::vector<std::string> split(const std::filesystem::path& path) const;
+    uint64_t digest(node* n);
+    void collect(node* n, const std::filesystem::path& path, change_type type, std::vector<change>& changes);
+    void diff(node* lhs, node* rhs, const std::filesystem::path& path, std::vector<change>& changes);
+
+    const std::filesystem::path m_root;
+    std::mutex m_mutex;
+    node m_rootNode;
+};
@@ -0,0 +1,244 @@
+#include "path_filter.h"
+
+#include "format.h"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <time.h>
+
+namespace {
+
+    bool is_wildcard(char c)
+    {
+        return c == '*' || c == '?' || c == '[' || c == '\\';
+    }
+
+    // [abc], [a-z], [!a-z]; p points after '[', set to the char after ']'
+    bool match_class(const char*& p, char c)
+    {
+        bool negate = *p == '!' || *p == '^';
+        if (negate)
+            ++p;
+
+        bool matched = false;
+        bool first = true;
+        while (*p && (*p != ']' || first)) {
+            first = false;
+            if (p[1] == '-' && p[2] && p[2] != ']') {
+                if (p[0] <= c && c <= p[2])
+                    matched = true;
+                p += 3;
+            }
+            else {
+                if (*p == c)
+                    matched = true;
+                ++p;
+            }
+        }
+        if (*p == ']')
+            ++p;
+        return matched != negate;
+    }
+
+    bool glob_match(const char* p, const char* t)
+    {
+        while (*p) {
+            if (p[0] == '*' && p[1] == '*') {
+                p += 2;
+                if (*p == '/') {
+                    // "**/" matches zero or more directories
+                    ++p;
+                    for (const char* s = t; ; ++s) {
+                        if (glob_match(p, s))
+                            return true;
+                        s = strchr(s, '/');
+                        if (!s)
+                            return false;
+                    }
+                }
+                for (const char* s = t; ; ++s) {
+                    if (glob_match(p, s))
+                        return true;
+                    if (!*s)
+                        return false;
+                }
+            }
+            if (*p == '*') {
+                ++p;
+                for (const char* s = t; ; ++s) {
+                    if (glob_match(p, s))
+                        return true;
+                    if (!*s || *s == '/')
+                        return false;
+                }
+            }
+            if (!*t)
+                return false;
+            if (*p == '?') {
+                if (*t == '/')
+                    return false;
+                ++p;
+                ++t;
+                continue;
+            }
+            if (*p == '[') {
+                ++p;
+                if (*t == '/' || !match_class(p, *t))
+                    return false;
+                ++t;
+                continue;
+            }
+            if (*p == '\\' && p[1])
+                ++p;
+            if (*p != *t)
+                return false;
+            ++p;
+            ++t;
+        }
+        return !*t;
+    }
+}
+
+void PathFilter::AddRule(const std::string& line)
+{
+    std::string pattern = line;
+    // trailing spaces are ignored unless escaped
+    while (!pattern.empty() && pattern.back() == ' ' && (pattern.size() < 2 || pattern[pattern.size() - 2] != '\\'))
+        pattern.pop_back();
+    if (pattern.empty() || pattern[0] == '#')
+        return;
+
+    rule r;
+    r.negate = pattern[0] == '!';
+    if (r.negate)
+        pattern.erase(0, 1);
+    else if (pattern[0] == '\\' && (pattern[1] == '!' || pattern[1] == '#'))
+        pattern.erase(0, 1);
+
+    r.dirOnly = !pattern.empty() && pattern.back() == '/';
+    if (r.dirOnly)
+        pattern.pop_back();
+
+    r.anchored = pattern.find('/') != std::string::npos;
+    if (r.anchored && pattern[0] == '/')
+        pattern.erase(0, 1);
+    if (pattern.empty())
+        throw std::runtime_error(string::format("invalid filter rule \"%s\"", line.c_str()));
+
+    size_t wildcards = 0;
+    for (char c : pattern)
+        wildcards += is_wildcard(c);
+    if (!wildcards)
+        r.kind = rule_kind::LITERAL;
+    else if (!r.anchored && wildcards == 1 && pattern[0] == '*')
+        r.kind = rule_kind::SUFFIX;
+    else
+        r.kind = rule_kind::GLOB;
+    if (r.kind == rule_kind::SUFFIX)
+        pattern.erase(0, 1);
+    r.pattern = pattern;
+
+    m_hasNegation = m_hasNegation || r.negate;
+    m_rules.push_back(r);
+
+    // the sets are used only without negations, then m_rules keeps just the rest
+    if (!m_hasNegation) {
+        m_names.clear();
+        m_dirNames.clear();
+        for (const auto& compiled : m_rules) {
+            if (compiled.kind == rule_kind::LITERAL && !compiled.anchored)
+                (compiled.dirOnly ? m_dirNames : m_names).insert(compiled.pattern);
+        }
+    }
+}
+
+void PathFilter::AddRulesFile(const std::string& filename)
+{
+    std::ifstream ifs(filename.c_str());
+    if (!ifs.good()) {
+        throw std::runtime_error(string::format("Unable to open %s", filename.c_str()));
+    }
+    std::string line;
+    while (std::getline(ifs, line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        AddRule(line);
+    }
+}
+
+void PathFilter::SetSizeLimits(uint64_t minSize, uint64_t maxSize)
+{
+    m_minSize = minSize;
+    m_maxSize = maxSize;
+}
+
+void PathFilter::SetAgeLimits(time_t minAge, time_t maxAge)
+{
+    m_minAge = minAge;
+    m_maxAge = maxAge;
+}
+
+bool PathFilter::Empty() const
+{
+    return m_rules.empty() && !m_minSize && !m_maxSize && !m_minAge && !m_maxAge;
+}
+
+bool PathFilter::matches(const rule& r, const std::string& relativePath, const std::string& name, bool isDir) const
+{
+    if (r.dirOnly && !isDir)
+        return false;
+
+    const std::string& subject = r.anchored ? relativePath : name;
+    switch (r.kind) {
+        case rule_kind::LITERAL:
+            return subject == r.pattern;
+        case rule_kind::SUFFIX:
+            return subject.size() >= r.pattern.size()
+                && subject.compare(subject.size() - r.pattern.size(), r.pattern.size(), r.pattern) == 0;
+        default:
+            return glob_match(r.pattern.c_str(), subject.c_str());
+    }
+}
+
+bool PathFilter::Excluded(const std::string& relativePath, bool isDir) const
+{
+    if (m_rules.empty())
+        return false;
+
+    const size_t slash = relativePath.rfind('/');
+    const std::string name = slash == std::string::npos ? relativePath : relativePath.substr(slash + 1);
+
+    if (!m_hasNegation) {
+        if (m_names.count(name) || (isDir && m_dirNames.count(name)))
+            return true;
+        for (const auto& r : m_rules) {
+            if ((r.kind != rule_kind::LITERAL || r.anchored) && matches(r, relativePath, name, isDir))
+                return true;
+        }
+        return false;
+    }
+
+    for (auto it = m_rules.rbegin(); it != m_rules.rend(); ++it) {
+        if (matches(*it, relativePath, name, isDir))
+            return !it->negate;
+    }
+    return false;
+}
+
+bool PathFilter::ExcludedFile(const struct stat& st) const
+{
+    if (m_minSize && (uint64_t)st.st_size < m_minSize)
+        return true;
+    if (m_maxSize && (uint64_t)st.st_size > m_maxSize)
+        return true;
+
+    if (m_minAge || m_maxAge) {
+        const time_t age = time(nullptr) - st.st_mtime;
+        if (m_minAge && age < m_minAge)
+            return true;
+        if (m_maxAge && age > m_maxAge)
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_set>
+#include <vector>
+
+// gitignore-style exclude rules compiled once, plus size and age predicates of the files.
+// The rules are matched to the path relative to the monitored root, the last matching rule wins:
+//   *.tmp       a name at any depth, * and ? don't match '/'
+//   /build/     anchored to the root, the trailing '/' matches directories only
+//   cache/**    ** matches any number of directories
+//   !keep.tmp   re-includes, but not inside an excluded directory, its subtree is pruned
+class PathFilter
+{
+public:
+
+    // throws on an invalid rule
+    void AddRule(const std::string& rule);
+    // one rule per line, '#' starts a comment
+    void AddRulesFile(const std::string& filename);
+    // 0 - unlimited
+    void SetSizeLimits(uint64_t minSize, uint64_t maxSize);
+    // mtime age in seconds, files younger than minAge or older than maxAge are excluded, 0 - unlimited
+    void SetAgeLimits(time_t minAge, time_t maxAge);
+
+    bool Empty() const;
+    bool Excluded(const std::string& relativePath, bool isDir) const;
+    bool ExcludedFile(const struct stat& st) const;
+
+private:
+
+    enum rule_kind {
+        LITERAL = 0, // no wildcards
+        SUFFIX,      // "*" followed by a literal, e.g. *.tmp
+        GLOB
+    };
+
+    struct rule {
+        std::string pattern;
+        rule_kind kind;
+        bool negate;
+        bool dirOnly;
+        // matched to the whole relative path, otherwise to the name
+        bool anchored;
+    };
+
+    bool matches(const rule& r, const std::string& relativePath, const std::string& name, bool isDir) const;
+
+    std::vector<rule> m_rules;
+    // without negations the order doesn't matter, the literal names are looked up in a set
+    bool m_hasNegation = false;
+    std::unordered_set<std::string> m_names;
+    std::unordered_set<std::string> m_dirNames;
+
+    uint64_t m_minSize = 0;
+    uint64_t m_maxSize = 0;
+    time_t m_minAge = 0;
+    time_t m_maxAge = 0;
+};
@@ -1,10 +1,18 @@
 #include "periodic_task.h"
 
+#include <algorithm>
 #include <functional>
+#include <syslog.h>
 #include <utility>
 
 PeriodicTask::PeriodicTask(int period, std::function<void()> action) //
-    : m_period(period), m_action(action)
+    : PeriodicTask(period, Schedule(), action)
+{
+}
+
+PeriodicTask::PeriodicTask(int period, const Schedule& schedule, std::function<void()> action,
+                           std::function<uint64_t()> readBytes) //
+    : m_period(period), m_schedule(schedule), m_random(std::random_device()()), m_action(action), m_readBytes(readBytes)
 
 {
     m_thread = std::thread(&PeriodicTask::loop, this);
@@ -19,6 +27,7 @@ PeriodicTask::~PeriodicTask()
 
     {
         std::lock_guard guard(m_mutex);
+        m_stop = true;
         m_cond.notify_all();
     }
 
@@ -26,8 +35,38 @@ PeriodicTask::~PeriodicTask()
         m_thread.join();
 }
 
+PeriodicTask::clock::duration PeriodicTask::interval(clock::duration actionDuration)
+{
+    using namespace std::chrono;
+
+    // nothing was measured before the first run
+    duration<double> result = seconds(m_period);
+    if (m_schedule.dutyCycle > 0 && actionDuration > clock::duration::zero()) {
+        result = duration<double>(actionDuration) / m_schedule.dutyCycle;
+        if (m_schedule.minPeriod > 0)
+            result = std::max(result, duration<double>(seconds(m_schedule.minPeriod)));
+        if (m_schedule.maxPeriod > 0)
+            result = std::min(result, duration<double>(seconds(m_schedule.maxPeriod)));
+    }
+
+    if (m_schedule.jitter > 0) {
+        std::uniform_real_distribution<double> shift(-m_schedule.jitter, m_schedule.jitter);
+        result *= 1.0 + shift(m_random);
+    }
+
+    return duration_cast<clock::duration>(result);
+}
+
+time_t PeriodicTask::NextRun() const
+{
+    return m_nextRun.load();
+}
+
 void PeriodicTask::loop()
 {
+    // starts are planned from the previous start, so the ticks don't drift by the action duration
+    clock::time_point next = clock::now() + interval(clock::duration::zero());
+
     while (true)
     {
 
@@ -41,9 +80,27 @@ void PeriodicTask::loop()
             m_isPromSet = true;
         }
 
-        if (m_cond.wait_for(lock, std::chrono::seconds(m_period)) == std::cv_status::no_timeout)
+        m_nextRun = time(nullptr) + std::chrono::duration_cast<std::chrono::seconds>(next - clock::now()).count();
+
+        // the overrun action leaves no time to wait, so the stop is checked by the flag, not by the notify
+        if (m_cond.wait_until(lock, next, [this]() { return m_stop; }))
             break;
 
+        const clock::time_point start = clock::now();
+        // the bytes of this action only, the other tasks may read in parallel
+        const uint64_t startBytes = m_readBytes ? m_readBytes() : 0;
+
         m_action();
+
+        const clock::duration actionDuration = clock::now() - start;
+        const clock::time_point planned = start + interval(actionDuration);
+        // the action took longer than the interval, the next one starts immediately
+        next = std::max(planned, clock::now());
+
+        // only the overruns are worth a notice, the frequent tasks would flood the log otherwise
+        syslog(planned < next ? LOG_WARNING : LOG_DEBUG, "Periodic task took %.1f s, read %llu bytes, next run in %lld s",
+            std::chrono::duration<double>(actionDuration).count(),
+            (unsigned long long)((m_readBytes ? m_readBytes() : 0) - startBytes),
+            (long long)std::chrono::duration_cast<std::chrono::seconds>(next - clock::now()).count());
     }
 }
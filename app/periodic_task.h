@@ -1,34 +1,64 @@
 #ifndef PERIODIC_TASK_BASE_H
 #define PERIODIC_TASK_BASE_H
 
+#include <atomic>
 #include <condition_variable>
 #include <functional>
 #include <future>
 #include <iostream>
 #include <mutex>
+#include <random>
 #include <thread>
+#include <time.h>
 
 class PeriodicTask
 {
   public:
+    // adaptive scheduling, the interval between the starts is calculated from the measured action duration
+    struct Schedule
+    {
+        // share of the wall time spent in the action, 0 - fixed period
+        double dutyCycle = 0;
+        // bounds of the adaptive interval in seconds, 0 - unbounded
+        int minPeriod = 0;
+        int maxPeriod = 0;
+        // random shift of each start, share of the interval, so hosts don't run in lockstep
+        double jitter = 0;
+    };
+
     PeriodicTask() = delete;
     virtual ~PeriodicTask();
 
     explicit PeriodicTask(int period, std::function<void()> action);
+    // readBytes - counter of the bytes read by the action, reported with its duration
+    PeriodicTask(int period, const Schedule& schedule, std::function<void()> action,
+                 std::function<uint64_t()> readBytes = nullptr);
+
+    // planned start of the next action
+    time_t NextRun() const;
 
   private:
+    typedef std::chrono::steady_clock clock;
+
     std::mutex m_mutex;
     std::condition_variable m_cond;
     std::thread m_thread;
     int m_period;
+    Schedule m_schedule;
+    std::mt19937 m_random;
+    std::atomic<time_t> m_nextRun{ 0 };
 
     // to control thread was started
     std::promise<bool> m_promise;
     // not atomic because uses only by one thread
     bool m_isPromSet = false;
+    // set by the destructor under m_mutex
+    bool m_stop = false;
 
     void loop();
+    clock::duration interval(clock::duration actionDuration);
     std::function<void()> m_action;
+    std::function<uint64_t()> m_readBytes;
 };
 
 #endif // PERIODIC_TASK_BASE_H
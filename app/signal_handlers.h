@@ -55,7 +55,8 @@ void terminateHandler()
     std::abort();
 }
 
-int g_signal = 0;
+// written by the signal handler, read by the main loop
+volatile sig_atomic_t g_signal = 0;
 
 void signalHandler(int signal)
 {
@@ -92,6 +93,29 @@ void registerHandlers()
     signal(SIGCONT, SIG_IGN); // why should we  stub SIGCONT if SIGSTOP acts as usual?
 
     std::set_terminate(terminateHandler);
+
+    // the threads inherit the blocked mask, so these signals are only taken by waitSignal()
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+}
+
+// waits for SIGTERM, SIGUSR1 or SIGUSR2, the signals received meanwhile stay pending until the next calls
+int waitSignal()
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    int signal = 0;
+    if (sigwait(&mask, &signal) != 0)
+        return 0;
+    g_signal = signal;
+    return signal;
 }
 
 }
@@ -0,0 +1,481 @@
+#include "snapshot.h"
+
+#include "format.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <future>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    // the output is flushed by blocks
+    const size_t OUTPUT_BLOCK = 1024 * 1024;
+
+    inline void skip_ws(const char*& p, const char* end)
+    {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+            ++p;
+    }
+
+    // p points to the opening quote, set after the closing one
+    bool scan_string(const char*& p, const char* end, const char*& begin, size_t& size, bool& escaped)
+    {
+        if (p >= end || *p != '"')
+            return false;
+        begin = ++p;
+        escaped = false;
+        while (true) {
+            const char* quote = (const char*)memchr(p, '"', end - p);
+            if (!quote)
+                return false;
+            // the quote is escaped by an odd number of backslashes
+            const char* slash = quote;
+            while (slash > begin && slash[-1] == '\\')
+                --slash;
+            if ((quote - slash) % 2 == 0) {
+                escaped = escaped || memchr(begin, '\\', quote - begin) != nullptr;
+                size = quote - begin;
+                p = quote + 1;
+                return true;
+            }
+            escaped = true;
+            p = quote + 1;
+        }
+    }
+
+    void append_utf8(std::string& out, uint32_t cp)
+    {
+        if (cp < 0x80) {
+            out += (char)cp;
+        }
+        else if (cp < 0x800) {
+            out += (char)(0xC0 | (cp >> 6));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+        else if (cp < 0x10000) {
+            out += (char)(0xE0 | (cp >> 12));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+        else {
+            out += (char)(0xF0 | (cp >> 18));
+            out += (char)(0x80 | ((cp >> 12) & 0x3F));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+    }
+
+    bool parse_hex(const char* p, size_t size, uint32_t& value)
+    {
+        value = 0;
+        if (!size)
+            return false;
+        for (size_t i = 0; i < size; ++i) {
+            const char c = p[i];
+            uint32_t digit;
+            if (c >= '0' && c <= '9')
+                digit = c - '0';
+            else if (c >= 'a' && c <= 'f')
+                digit = c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                digit = c - 'A' + 10;
+            else
+                return false;
+            value = (value << 4) | digit;
+        }
+        return true;
+    }
+
+    bool unescape(const char* p, size_t size, std::string& out)
+    {
+        out.reserve(size);
+        const char* end = p + size;
+        while (p < end) {
+            if (*p != '\\') {
+                out += *p++;
+                continue;
+            }
+            if (++p >= end)
+                return false;
+            switch (*p++) {
+                case '"':  out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/':  out += '/'; break;
+                case 'b':  out += '\b'; break;
+                case 'f':  out += '\f'; break;
+                case 'n':  out += '\n'; break;
+                case 'r':  out += '\r'; break;
+                case 't':  out += '\t'; break;
+                case 'u': {
+                    uint32_t cp, low;
+                    if (end - p < 4 || !parse_hex(p, 4, cp))
+                        return false;
+                    p += 4;
+                    // surrogate pair
+                    if (cp >= 0xD800 && cp < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u'
+                        && parse_hex(p + 2, 4, low) && low >= 0xDC00 && low < 0xE000) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        p += 6;
+                    }
+                    append_utf8(out, cp);
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    // strings, numbers, literals, nested objects and arrays of the unknown keys
+    bool skip_value(const char*& p, const char* end)
+    {
+        const char* begin;
+        size_t size;
+        bool escaped;
+        if (p >= end)
+            return false;
+        if (*p == '"')
+            return scan_string(p, end, begin, size, escaped);
+        if (*p == '{' || *p == '[') {
+            size_t depth = 0;
+            while (p < end) {
+                if (*p == '"') {
+                    if (!scan_string(p, end, begin, size, escaped))
+                        return false;
+                    continue;
+                }
+                if (*p == '{' || *p == '[')
+                    ++depth;
+                else if ((*p == '}' || *p == ']') && --depth == 0) {
+                    ++p;
+                    return true;
+                }
+                ++p;
+            }
+            return false;
+        }
+        const char* start = p;
+        while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\n' && *p != '\r' && *p != '\t')
+            ++p;
+        return p > start;
+    }
+
+    bool parse_uint(const char*& p, const char* end, uint64_t& value)
+    {
+        const char* start = p;
+        value = 0;
+        while (p < end && *p >= '0' && *p <= '9')
+            value = value * 10 + (*p++ - '0');
+        return p > start;
+    }
+
+    // "0X%08X" of Save() or a number
+    bool parse_crc(const char*& p, const char* end, uint32_t& crc)
+    {
+        if (p < end && *p == '"') {
+            const char* begin;
+            size_t size;
+            bool escaped;
+            if (!scan_string(p, end, begin, size, escaped))
+                return false;
+            if (size > 2 && begin[0] == '0' && (begin[1] == 'X' || begin[1] == 'x')) {
+                begin += 2;
+                size -= 2;
+            }
+            return size <= 8 && parse_hex(begin, size, crc);
+        }
+        uint64_t value;
+        if (!parse_uint(p, end, value) || value > UINT32_MAX)
+            return false;
+        crc = (uint32_t)value;
+        return true;
+    }
+
+    inline bool key_is(const char* key, size_t size, const char* name)
+    {
+        return size == strlen(name) && memcmp(key, name, size) == 0;
+    }
+
+    // 8 bytes of the path from depth in big-endian order, the end is padded by zeros
+    inline uint64_t path_key(const char* path, size_t size, size_t depth)
+    {
+        uint64_t key = 0;
+        for (size_t i = depth; i < depth + sizeof(key); ++i)
+            key = (key << 8) | (i < size ? (unsigned char)path[i] : 0);
+        return key;
+    }
+
+    // multikey sort: the entries are ordered by the cached keys, then only the runs of equal keys
+    // load the next 8 bytes, so the paths are read once per level instead of once per comparison
+    void sort_entries(Snapshot::entry* first, Snapshot::entry* last, size_t depth)
+    {
+        for (auto it = first; it != last; ++it)
+            it->key = path_key(it->path, it->pathSize, depth);
+        std::sort(first, last, [](const Snapshot::entry& lhs, const Snapshot::entry& rhs) { return lhs.key < rhs.key; });
+
+        while (first != last) {
+            auto run = first + 1;
+            while (run != last && run->key == first->key)
+                ++run;
+            // paths have no zero bytes, so a zero at the end of the key means the paths are equal
+            if (run - first > 1 && (first->key & 0xFF))
+                sort_entries(first, run, depth + sizeof(first->key));
+            first = run;
+        }
+    }
+
+    // the paths are equal up to skip
+    inline int compare_paths(const Snapshot::entry& lhs, const Snapshot::entry& rhs, size_t skip)
+    {
+        const int cmp = memcmp(lhs.path + skip, rhs.path + skip, std::min(lhs.pathSize, rhs.pathSize) - skip);
+        if (cmp)
+            return cmp;
+        return lhs.pathSize < rhs.pathSize ? -1 : (lhs.pathSize > rhs.pathSize ? 1 : 0);
+    }
+
+    size_t common_prefix(const char* lhs, size_t lhsSize, const char* rhs, size_t rhsSize)
+    {
+        size_t i = 0;
+        const size_t size = std::min(lhsSize, rhsSize);
+        while (i < size && lhs[i] == rhs[i])
+            ++i;
+        return i;
+    }
+}
+
+Snapshot::Snapshot(const std::string& filename)
+    : m_filename(filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error(string::format("Unable to open %s: %s", filename.c_str(), strerror(errno)));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error(string::format("%s is empty", filename.c_str()));
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error(string::format("Unable to map %s: %s", filename.c_str(), strerror(errno)));
+    }
+    m_data = (const char*)data;
+    m_size = st.st_size;
+    madvise(data, m_size, MADV_SEQUENTIAL);
+
+    parse();
+}
+
+Snapshot::~Snapshot()
+{
+    if (m_data) {
+        munmap((void*)m_data, m_size);
+    }
+}
+
+void Snapshot::error(const char* pos, const char* what) const
+{
+    throw std::runtime_error(string::format("%s: %s at offset %zu", m_filename.c_str(), what, (size_t)(pos - m_data)));
+}
+
+void Snapshot::parse()
+{
+    const char* p = m_data;
+    const char* end = m_data + m_size;
+
+    // one line of Save() is about 150 bytes
+    m_entries.reserve(m_size / 128);
+
+    skip_ws(p, end);
+    if (p >= end || *p++ != '[')
+        error(p, "array expected");
+    skip_ws(p, end);
+    // the older versions exported an empty tree without the closing bracket
+    if (p >= end || *p == ']')
+        return;
+
+    while (true) {
+        skip_ws(p, end);
+        if (p >= end || *p++ != '{')
+            error(p, "object expected");
+
+        entry e{};
+        const char* path = nullptr;
+        size_t pathSize = 0;
+        bool pathEscaped = false;
+        uint32_t etalonCrc = 0, resultCrc = 0;
+        uint64_t lastVerified = 0;
+        const char* status = "";
+        size_t statusSize = 0;
+
+        skip_ws(p, end);
+        if (p < end && *p == '}') {
+            error(p, "entry without a path");
+        }
+        while (true) {
+            const char* key;
+            size_t keySize;
+            bool keyEscaped;
+            skip_ws(p, end);
+            if (!scan_string(p, end, key, keySize, keyEscaped))
+                error(p, "key expected");
+            skip_ws(p, end);
+            if (p >= end || *p++ != ':')
+                error(p, "':' expected");
+            skip_ws(p, end);
+
+            bool ok;
+            if (key_is(key, keySize, "path"))
+                ok = scan_string(p, end, path, pathSize, pathEscaped);
+            else if (key_is(key, keySize, "etalon_crc32"))
+                ok = parse_crc(p, end, etalonCrc);
+            else if (key_is(key, keySize, "result_crc32"))
+                ok = parse_crc(p, end, resultCrc);
+            else if (key_is(key, keySize, "status")) {
+                bool escaped;
+                ok = scan_string(p, end, status, statusSize, escaped);
+            }
+            else if (key_is(key, keySize, "size"))
+                ok = parse_uint(p, end, e.size);
+            else if (key_is(key, keySize, "last_verified"))
+                ok = parse_uint(p, end, lastVerified);
+            else
+                ok = skip_value(p, end);
+            if (!ok)
+                error(p, "invalid value");
+
+            skip_ws(p, end);
+            if (p < end && *p == ',') {
+                ++p;
+                continue;
+            }
+            if (p >= end || *p++ != '}')
+                error(p, "',' or '}' expected");
+            break;
+        }
+
+        if (!path)
+            error(p, "entry without a path");
+        if (pathEscaped) {
+            m_decoded.emplace_back();
+            if (!unescape(path, pathSize, m_decoded.back()))
+                error(path, "invalid escape sequence");
+            path = m_decoded.back().data();
+            pathSize = m_decoded.back().size();
+        }
+        e.path = path;
+        e.pathSize = pathSize;
+        // result_crc32 is valid once the file was verified, 0 is a real checksum too
+        e.crc = lastVerified ? resultCrc : etalonCrc;
+
+        // a handful of distinct statuses
+        auto it = std::find_if(m_statuses.begin(), m_statuses.end(),
+            [&](const std::string& name) { return name.size() == statusSize && memcmp(name.data(), status, statusSize) == 0; });
+        e.status = it - m_statuses.begin();
+        if (it == m_statuses.end())
+            m_statuses.emplace_back(status, statusSize);
+
+        m_entries.push_back(e);
+
+        skip_ws(p, end);
+        if (p < end && *p == ',') {
+            ++p;
+            continue;
+        }
+        if (p >= end || *p++ != ']')
+            error(p, "',' or ']' expected");
+        break;
+    }
+}
+
+size_t Snapshot::commonPrefix() const
+{
+    if (m_entries.empty())
+        return 0;
+    const entry& first = m_entries.front();
+    size_t common = first.pathSize;
+    for (const auto& e : m_entries) {
+        common = common_prefix(first.path, common, e.path, e.pathSize);
+    }
+    return common;
+}
+
+void Snapshot::sort(size_t skip)
+{
+    m_skip = skip;
+    sort_entries(m_entries.data(), m_entries.data() + m_entries.size(), skip);
+}
+
+void Snapshot::Sort(Snapshot& before, Snapshot& after)
+{
+    // the roots are usually the same, so the sort keys are taken after the common part of all the paths
+    size_t skip = std::min(before.commonPrefix(), after.commonPrefix());
+    if (!before.m_entries.empty() && !after.m_entries.empty()) {
+        const entry& lhs = before.m_entries.front();
+        const entry& rhs = after.m_entries.front();
+        skip = std::min(skip, common_prefix(lhs.path, lhs.pathSize, rhs.path, rhs.pathSize));
+    }
+
+    auto sorted = std::async(std::launch::async, &Snapshot::sort, &before, skip);
+    after.sort(skip);
+    sorted.get();
+}
+
+Snapshot::compare_stats Snapshot::Compare(const Snapshot& before, const Snapshot& after, FILE* out)
+{
+    compare_stats stats;
+    const size_t skip = before.m_skip;
+    std::string buffer;
+    buffer.reserve(OUTPUT_BLOCK + 4096);
+
+    auto print = [&](const char* change, const Snapshot& snapshot, const entry& e, const Snapshot* newSnapshot, const entry* newEntry)
+    {
+        buffer += "{ \"change\": \"";
+        buffer += change;
+        buffer += "\", \"path\": \"";
+        buffer += string::escape_json(std::string(e.path, e.pathSize));
+        buffer += string::format("\", \"crc32\": \"0X%08X\", \"status\": \"%s\", \"size\": %llu",
+            e.crc, string::escape_json(snapshot.m_statuses[e.status]).c_str(), (unsigned long long)e.size);
+        if (newEntry) {
+            buffer += string::format(", \"new_crc32\": \"0X%08X\", \"new_status\": \"%s\", \"new_size\": %llu",
+                newEntry->crc, string::escape_json(newSnapshot->m_statuses[newEntry->status]).c_str(), (unsigned long long)newEntry->size);
+        }
+        buffer += "}\n";
+        if (buffer.size() >= OUTPUT_BLOCK) {
+            fwrite(buffer.data(), 1, buffer.size(), out);
+            buffer.clear();
+        }
+    };
+
+    const auto& lhs = before.m_entries;
+    const auto& rhs = after.m_entries;
+    size_t i = 0, j = 0;
+    while (i < lhs.size() || j < rhs.size()) {
+        const int cmp = i == lhs.size() ? 1 : (j == rhs.size() ? -1 : compare_paths(lhs[i], rhs[j], skip));
+        if (cmp < 0) {
+            print("REMOVED", before, lhs[i++], nullptr, nullptr);
+            ++stats.removed;
+        }
+        else if (cmp > 0) {
+            print("ADDED", after, rhs[j++], nullptr, nullptr);
+            ++stats.added;
+        }
+        else {
+            const entry& old = lhs[i++];
+            const entry& now = rhs[j++];
+            if (old.crc != now.crc || old.size != now.size || before.m_statuses[old.status] != after.m_statuses[now.status]) {
+                print("CHANGED", before, old, &after, &now);
+                ++stats.changed;
+            }
+        }
+    }
+    fwrite(buffer.data(), 1, buffer.size(), out);
+    fflush(out);
+    return stats;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <deque>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// Read-only result.json export of DirScanner::Save(), mapped into memory.
+// The paths point into the mapping, only the escaped ones are decoded into separate strings.
+class Snapshot
+{
+public:
+
+    struct entry {
+        // sort key, 8 bytes of the path
+        uint64_t key;
+        const char* path;
+        uint32_t pathSize;
+        // result_crc32 if the file was verified (last_verified is set), etalon_crc32 otherwise
+        uint32_t crc;
+        uint64_t size;
+        // index in Statuses()
+        uint32_t status;
+    };
+
+    // throws on a malformed file, the unknown keys are skipped
+    explicit Snapshot(const std::string& filename);
+    Snapshot(const Snapshot&) = delete;
+    Snapshot operator=(const Snapshot&) = delete;
+    ~Snapshot();
+
+    // sorted by path after Sort()
+    const std::vector<entry>& Entries() const { return m_entries; }
+    const std::vector<std::string>& Statuses() const { return m_statuses; }
+
+    struct compare_stats {
+        size_t added = 0;
+        size_t removed = 0;
+        size_t changed = 0;
+    };
+
+    // both snapshots are sorted in parallel, the common prefix of the paths is skipped
+    static void Sort(Snapshot& before, Snapshot& after);
+    // sort-merge join on the path of the sorted snapshots, one JSON line per added, removed or changed entry
+    static compare_stats Compare(const Snapshot& before, const Snapshot& after, FILE* out);
+
+private:
+
+    void parse();
+    size_t commonPrefix() const;
+    void sort(size_t skip);
+    [[noreturn]] void error(const char* pos, const char* what) const;
+
+    const std::string m_filename;
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+    std::vector<entry> m_entries;
+    // length of the path prefix skipped by the comparisons
+    size_t m_skip = 0;
+    std::vector<std::string> m_statuses;
+    std::deque<std::string> m_decoded;
+};
@@ -5,19 +5,22 @@
 #include <mutex>
 #include <condition_variable>
 #include <vector>
+#include <algorithm>
 #include <atomic>
 #include "thread_pool_queue.h"
+#include "trace.h"
 
 class ThreadPool
 {
 public:
 
-    ThreadPool(int threads, int queue_size):m_done(false), m_tasks(queue_size)
+    // all the threads are started, the workers with index >= active are parked until Resize()
+    ThreadPool(int threads, int queue_size, int active = 0):m_done(false), m_active(active > 0 ? std::min(active, threads) : threads), m_tasks(queue_size)
     {
         try
         {
             for( int i = 0; i < threads; ++i ) {
-                std::thread th(&ThreadPool::worker, this);
+                std::thread th(&ThreadPool::worker, this, i);
                 m_threads.push_back(std::move(th));
             }
         }
@@ -35,12 +38,12 @@ public:
     }
 
     template < typename FuncType >
-    bool addTask(FuncType f)
+    bool addTask(FuncType f, ThreadPoolQueue::priority prio = ThreadPoolQueue::PERIODIC, int owner = 0)
     {
         {
             std::lock_guard< std::mutex > lg(m_mut);
 
-            if ( !m_tasks.push(ThreadPoolQueue::ThreadFunc(f)) )
+            if ( !m_tasks.push(ThreadPoolQueue::ThreadFunc(f), prio, owner) )
                 return false;
         }
         m_cond.notify_one();
@@ -48,29 +51,73 @@ public:
         return true;
     }
 
+    ThreadPoolQueue::lane_stats queueStats(ThreadPoolQueue::priority prio) const
+    {
+        return m_tasks.stats(prio);
+    }
+
+    // the running tasks are completed, then the extra workers are parked
+    void Resize(int active)
+    {
+        {
+            std::lock_guard< std::mutex > lg(m_mut);
+            m_active = std::max(1, std::min(active, Capacity()));
+        }
+        m_cond.notify_all();
+        m_parked.notify_all();
+    }
+
+    int Active() const
+    {
+        return m_active;
+    }
+
+    int Capacity() const
+    {
+        return (int)m_threads.size();
+    }
+
+    size_t queueSize()
+    {
+        std::lock_guard< std::mutex > lg(m_mut);
+        return m_tasks.size();
+    }
+
 private:
 
     std::atomic< bool > m_done;
     std::mutex m_mut;
     std::condition_variable m_cond;
+    // parked workers wait on their own condition, so notify_one always wakes an active worker
+    std::condition_variable m_parked;
+    std::atomic< int > m_active;
 
     ThreadPoolQueue m_tasks;
     std::vector< std::thread > m_threads;
 
-    void worker()
+    void worker(int index)
     {
         ThreadPoolQueue::ThreadFunc f;
+        std::chrono::microseconds wait{ 0 };
 
         while( 1 )
         {
             {
                 std::unique_lock< std::mutex > ul(m_mut);
-                m_cond.wait(ul, [&]{return !m_tasks.isEmpty();});
+                while ( !m_done )
+                {
+                    if ( index >= m_active )
+                        m_parked.wait(ul);
+                    else if ( m_tasks.isEmpty() )
+                        m_cond.wait(ul);
+                    else
+                        break;
+                }
 
                 if ( m_done )
                     return;
 
-                f = m_tasks.pop();
+                f = m_tasks.pop(&wait);
 
                 //
                 // if tasks stay in queue
@@ -79,6 +126,8 @@ private:
                     m_cond.notify_one();
             }
 
+            trace::Scope taskScope("task");
+            taskScope.Arg("queue_wait_us", wait.count());
             f();
         }
     }
@@ -90,8 +139,9 @@ private:
         //
         // add empty task for unlock condition
         //
-        addTask(ThreadPoolQueue::ThreadFunc());
+        addTask(ThreadPoolQueue::ThreadFunc(), ThreadPoolQueue::INTERACTIVE);
         m_cond.notify_all();
+        m_parked.notify_all();
 
         for( size_t i = 0; i < m_threads.size(); ++i )
         {
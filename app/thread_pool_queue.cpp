@@ -1,26 +1,78 @@
 #include "thread_pool_queue.h"
 
-bool ThreadPoolQueue::push(const ThreadFunc& func)
+bool ThreadPoolQueue::push(const ThreadFunc& func, priority prio, int owner)
 {
     std::lock_guard< std::mutex > lg(m_mut);
     
-    if ( (int)m_queue.size() >= m_maxSize )
+    lane& l = m_queue[ prio ];
+    if ( (int)l.size >= m_maxSize )
         return false;
     
-    m_queue.push(func);
+    task_queue& q = l.queues[ owner ];
+    if ( q.empty() )
+        l.owners.push_back(owner);
+
+    q.emplace(func, clock::now());
+    ++l.size;
     
     return true;
 }
 
-ThreadPoolQueue::ThreadFunc ThreadPoolQueue::pop()
+ThreadPoolQueue::ThreadFunc ThreadPoolQueue::pop(std::chrono::microseconds* wait)
 {
     std::lock_guard< std::mutex > lg(m_mut);
-    
-    if ( m_queue.empty() )
+
+    int selected = -1;
+    for( int i = 0; i < PRIORITIES_COUNT; ++i )
+    {
+        if ( !m_queue[ i ].size )
+            continue;
+
+        //
+        // starved lane goes first, otherwise the highest priority one
+        //
+        if ( m_skipped[ i ] >= STARVATION_LIMIT )
+        {
+            selected = i;
+            break;
+        }
+        if ( selected < 0 )
+            selected = i;
+    }
+
+    if ( selected < 0 )
         return ThreadFunc();
-    
-    ThreadFunc f = m_queue.front();
-    m_queue.pop();
+
+    for( int i = 0; i < PRIORITIES_COUNT; ++i )
+    {
+        if ( i == selected )
+            m_skipped[ i ] = 0;
+        else if ( i > selected && m_queue[ i ].size )
+            ++m_skipped[ i ];
+    }
+
+    ThreadPoolQueue::lane& l = m_queue[ selected ];
+    const int owner = l.owners.front();
+    l.owners.pop_front();
+
+    task_queue& q = l.queues[ owner ];
+    auto [ f, pushed ] = q.front();
+    q.pop();
+    --l.size;
+
+    if ( q.empty() )
+        l.queues.erase(owner);
+    else
+        l.owners.push_back(owner);
+
+    auto waited = std::chrono::duration_cast< std::chrono::microseconds >(clock::now() - pushed);
+    lane_stats& st = m_stats[ selected ];
+    ++st.count;
+    st.total_wait += waited;
+    if ( waited > st.max_wait )
+        st.max_wait = waited;
+    if ( wait )
+        *wait = waited;
     
     return f;
 }
@@ -29,12 +81,29 @@ size_t ThreadPoolQueue::size() const
 {
     std::lock_guard< std::mutex > lg(m_mut);
     
-    return m_queue.size();
+    size_t size = 0;
+    for( const auto& l : m_queue )
+        size += l.size;
+
+    return size;
 }
 
 bool ThreadPoolQueue::isEmpty() const
 {
     std::lock_guard< std::mutex > lg(m_mut);
     
-    return m_queue.empty();
+    for( const auto& l : m_queue )
+    {
+        if ( l.size )
+            return false;
+    }
+
+    return true;
+}
+
+ThreadPoolQueue::lane_stats ThreadPoolQueue::stats(priority prio) const
+{
+    std::lock_guard< std::mutex > lg(m_mut);
+
+    return m_stats[ prio ];
 }
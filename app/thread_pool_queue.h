@@ -1,7 +1,10 @@
 #ifndef THREADPOOLQUEUE_H
 #define	THREADPOOLQUEUE_H
 
+#include <chrono>
+#include <deque>
 #include <queue>
+#include <unordered_map>
 #include <functional>
 #include <mutex>
 
@@ -10,17 +13,51 @@ class ThreadPoolQueue
 public:
     
     typedef std::function< void() > ThreadFunc;
-    
+
+    // lanes are served from the highest priority, lower lanes are served at least once per STARVATION_LIMIT pops
+    enum priority {
+        INTERACTIVE = 0, // watcher events, requests on specific paths
+        PERIODIC,        // full scans
+        BACKGROUND,      // rolling re-verification
+        PRIORITIES_COUNT
+    };
+
+    struct lane_stats {
+        size_t count = 0;
+        std::chrono::microseconds total_wait{ 0 };
+        std::chrono::microseconds max_wait{ 0 };
+    };
+
+    static const int STARVATION_LIMIT = 16;
+
+    // nSize limits each lane, so bulk work can't fill the queue for the interactive tasks
     ThreadPoolQueue(int nSize = 100000):m_maxSize(nSize){}
     
-    bool push(const ThreadFunc &func);
-    ThreadFunc pop();
+    // the owners (monitored roots) of the same lane are served in round robin
+    bool push(const ThreadFunc &func, priority prio = PERIODIC, int owner = 0);
+    // wait is set to the time the task spent in the queue
+    ThreadFunc pop(std::chrono::microseconds* wait = nullptr);
     size_t size() const;
     bool isEmpty() const;
+    lane_stats stats(priority prio) const;
     
 private:
-    
-    std::queue< ThreadFunc > m_queue;
+
+    typedef std::chrono::steady_clock clock;
+
+    typedef std::queue< std::pair< ThreadFunc, clock::time_point > > task_queue;
+
+    struct lane {
+        std::unordered_map< int, task_queue > queues;
+        // owners with queued tasks in the serving order
+        std::deque< int > owners;
+        size_t size = 0;
+    };
+
+    lane m_queue[PRIORITIES_COUNT];
+    // pops from the higher lanes while the lane was not empty
+    int m_skipped[PRIORITIES_COUNT] = {};
+    lane_stats m_stats[PRIORITIES_COUNT];
     int m_maxSize;
     mutable std::mutex m_mut;
 };
@@ -0,0 +1,189 @@
+#include "trace.h"
+
+#include "format.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+namespace trace
+{
+
+namespace {
+
+    const size_t RING_SIZE = 1 << 15;
+
+    struct event {
+        // index + 1 of the recorded event, 0 while the slot is being written
+        std::atomic<uint64_t> sequence{ 0 };
+        const char* name;
+        uint64_t start;
+        uint64_t duration;
+        int argsCount;
+        const char* argNames[Scope::MAX_ARGS];
+        uint64_t args[Scope::MAX_ARGS];
+    };
+
+    // single writer, the oldest events are overwritten
+    struct ring {
+        explicit ring(long tid) : tid(tid), events(RING_SIZE) {}
+
+        const long tid;
+        std::vector<event> events;
+        std::atomic<uint64_t> head{ 0 };
+    };
+
+    std::atomic<unsigned> g_sampling{ 0 }; // 0 - disabled
+    std::mutex g_ringsMutex;
+    std::vector< std::shared_ptr<ring> > g_rings;
+
+    thread_local std::shared_ptr<ring> t_ring;
+    thread_local unsigned t_depth = 0;
+    thread_local unsigned t_counter = 0;
+    thread_local bool t_sampled = false;
+
+    const std::chrono::steady_clock::time_point g_epoch = std::chrono::steady_clock::now();
+
+    inline uint64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - g_epoch).count();
+    }
+
+    ring* thread_ring()
+    {
+        if (!t_ring) {
+            t_ring = std::make_shared<ring>((long)syscall(SYS_gettid));
+            std::lock_guard lock(g_ringsMutex);
+            g_rings.push_back(t_ring);
+        }
+        return t_ring.get();
+    }
+}
+
+void Enable(unsigned sampling)
+{
+    g_sampling.store(std::max(1u, sampling), std::memory_order_relaxed);
+}
+
+void Disable()
+{
+    g_sampling.store(0, std::memory_order_relaxed);
+}
+
+bool Enabled()
+{
+    return g_sampling.load(std::memory_order_relaxed) != 0;
+}
+
+void Dump(const std::string& filename)
+{
+    std::ofstream ofs(filename.c_str());
+    if (!ofs.good()) {
+        throw std::runtime_error(string::format("Unable to open %s", filename.c_str()));
+    }
+
+    std::vector< std::shared_ptr<ring> > rings;
+    {
+        std::lock_guard lock(g_ringsMutex);
+        rings = g_rings;
+    }
+
+    const long pid = getpid();
+    bool first = true;
+    ofs << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    for (const auto& r : rings) {
+        // the slot at head - RING_SIZE is the next one to be overwritten
+        const uint64_t head = r->head.load(std::memory_order_acquire);
+        const uint64_t begin = head >= RING_SIZE ? head - RING_SIZE + 1 : 0;
+        for (uint64_t i = begin; i < head; ++i) {
+            const event& e = r->events[i % RING_SIZE];
+            // the events overwritten by the owner thread during the dump are skipped by the sequence check
+            const uint64_t sequence = e.sequence.load(std::memory_order_acquire);
+            const char* name = e.name;
+            const uint64_t start = e.start;
+            const uint64_t duration = e.duration;
+            const int argsCount = std::min(std::max(e.argsCount, 0), (int)Scope::MAX_ARGS);
+            const char* argNames[Scope::MAX_ARGS];
+            uint64_t args[Scope::MAX_ARGS];
+            for (int a = 0; a < argsCount; ++a) {
+                argNames[a] = e.argNames[a];
+                args[a] = e.args[a];
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence != i + 1 || e.sequence.load(std::memory_order_relaxed) != sequence) {
+                continue;
+            }
+
+            std::string argsJson;
+            for (int a = 0; a < argsCount; ++a) {
+                argsJson += string::format("%s\"%s\": %llu", a ? ", " : "", argNames[a] ? argNames[a] : "arg",
+                    (unsigned long long)args[a]);
+            }
+            ofs << string::format("%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %ld, \"tid\": %ld, \"ts\": %.3f, \"dur\": %.3f, \"args\": {%s}}",
+                first ? "" : ",", name ? name : "unknown", pid, r->tid, start / 1000.0, duration / 1000.0, argsJson.c_str());
+            first = false;
+        }
+    }
+    ofs << "\n]}\n";
+}
+
+Scope::Scope(const char* name)
+    : m_name(name), m_recorded(false), m_start(0)
+{
+    const unsigned sampling = g_sampling.load(std::memory_order_relaxed);
+    if (t_depth++ == 0) {
+        // the sampling decision is made by the top-level scope and inherited by the nested ones
+        t_sampled = sampling && ++t_counter % sampling == 0;
+    }
+    if (!t_sampled || !sampling) {
+        return;
+    }
+
+    // the ring is allocated once per thread before the measurement
+    thread_ring();
+    m_recorded = true;
+    m_start = now();
+}
+
+Scope::~Scope()
+{
+    --t_depth;
+    if (!m_recorded) {
+        return;
+    }
+
+    ring* r = thread_ring();
+    const uint64_t head = r->head.load(std::memory_order_relaxed);
+    event& e = r->events[head % RING_SIZE];
+    e.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    e.name = m_name;
+    e.start = m_start;
+    e.duration = now() - m_start;
+    e.argsCount = m_argsCount;
+    for (int i = 0; i < m_argsCount; ++i) {
+        e.argNames[i] = m_argNames[i];
+        e.args[i] = m_args[i];
+    }
+    e.sequence.store(head + 1, std::memory_order_release);
+    r->head.store(head + 1, std::memory_order_release);
+}
+
+void Scope::Arg(const char* name, uint64_t value)
+{
+    if (!m_recorded || m_argsCount >= MAX_ARGS) {
+        return;
+    }
+    m_argNames[m_argsCount] = name;
+    m_args[m_argsCount] = value;
+    ++m_argsCount;
+}
+
+}
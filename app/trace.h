@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+// Low overhead scope tracing into per-thread preallocated ring buffers,
+// dumped as Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev).
+// Only one of `sampling` top-level scopes of a thread is recorded together with its nested scopes.
+namespace trace
+{
+
+// sampling 1 records every scope
+void Enable(unsigned sampling = 1);
+void Disable();
+bool Enabled();
+// writes the recorded events, throws on an I/O error
+void Dump(const std::string& filename);
+
+class Scope
+{
+public:
+    // name must be a string literal
+    explicit Scope(const char* name);
+    Scope(const Scope&) = delete;
+    Scope operator=(const Scope&) = delete;
+    ~Scope();
+
+    // numeric argument shown in the event details, up to MAX_ARGS, name must be a string literal
+    void Arg(const char* name, uint64_t value);
+    bool Recorded() const { return m_recorded; }
+
+    static const int MAX_ARGS = 3;
+
+private:
+    const char* m_name;
+    bool m_recorded;
+    uint64_t m_start;
+    int m_argsCount = 0;
+    const char* m_argNames[MAX_ARGS];
+    uint64_t m_args[MAX_ARGS];
+};
+
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) trace::Scope TRACE_CONCAT(traceScope, __LINE__)(name)
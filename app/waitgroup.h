@@ -8,7 +8,13 @@ class WaitGroup
 {
 public:
     void Add(int incr = 1) { counter += incr; }
-    void Done() { if (--counter <= 0) cond.notify_all(); }
+    void Done() {
+        if (--counter <= 0) {
+            // under the mutex, so the notify can't fall between the check and the wait of Wait()
+            std::lock_guard<std::mutex> lock(mutex);
+            cond.notify_all();
+        }
+    }
     void Wait() {
         std::unique_lock<std::mutex> lock(mutex);
         cond.wait(lock, [&] { return counter <= 0; });
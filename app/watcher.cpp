@@ -23,17 +23,28 @@ Watcher::~Watcher() {
     close( m_fd );
 }
 
-void Watcher::AddWatch(const std::string& path) {
+void Watcher::AddWatch(const std::string& path, callback_fn callback, exclude_fn exclude) {
     // IN_MODIFY invokes an event twice, so IN_CLOSE_WRITE is used
     int wd = inotify_add_watch(m_fd, path.c_str(), IN_DELETE | IN_CREATE | IN_CLOSE_WRITE);
     if ( wd < 0 ) {
         throw std::runtime_error("Cannot add watch to the directory");
     }
-    m_wdDirMap[wd] = path;
+    std::lock_guard lock(m_mutex);
+    m_wdDirMap[wd] = watch{ path, callback, exclude };
 }
 
-void Watcher::SetCallback(const std::function< void(const std::string) > callback) {
-    m_fn = callback;
+void Watcher::RemoveWatches(const std::string& root) {
+    std::lock_guard lock(m_mutex);
+    for (auto it = m_wdDirMap.begin(); it != m_wdDirMap.end(); ) {
+        const std::string& path = it->second.path;
+        if (path.compare(0, root.size(), root) == 0 && (path.size() == root.size() || path[root.size()] == '/')) {
+            inotify_rm_watch(m_fd, it->first);
+            it = m_wdDirMap.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
 }
 
 void Watcher::RunWatcher () {
@@ -47,20 +58,30 @@ void Watcher::RunWatcher () {
 
         auto handle_event = [this](const inotify_event* event)
         {
-            const std::string path = m_wdDirMap[event->wd] + "/" + event->name;
+            // the callbacks run under the lock, so the owner of a removed watch may be destroyed right after
+            std::lock_guard lock(m_mutex);
+            auto it = m_wdDirMap.find(event->wd);
+            if (it == m_wdDirMap.end())
+                return;
+            const watch& w = it->second;
+            const std::string path = w.path + "/" + event->name;
+            if (w.exclude && w.exclude(path, event->mask & IN_ISDIR)) {
+                return;
+            }
 
             if ( event->mask & IN_DELETE) {
                 if (event->mask & IN_ISDIR)
                     syslog(LOG_ERR, "Integrity check: FAIL (%s - the directory was removed)", path.c_str());
-                else 
-                    syslog(LOG_ERR, "Integrity check: FAIL (%s - the file was removed)", path.c_str());
+                else
+                    // the callback reports the removal of a tracked file
+                    w.fn(path);
             }
             if ( event->mask & IN_CREATE) {
                 if (event->mask & IN_ISDIR)
                     syslog(LOG_INFO, "The directory %s was created", path.c_str());
                 else {
                     syslog(LOG_INFO, "The file %s was created, recalculating", path.c_str());
-                    m_fn(path);
+                    w.fn(path);
                 }
             }
             if ( event->mask & IN_CLOSE_WRITE) {
@@ -68,7 +89,7 @@ void Watcher::RunWatcher () {
                     syslog(LOG_INFO, "The directory %s was modified", path.c_str());
                 else {
                     syslog(LOG_INFO, "The file %s was modified, recalculating", path.c_str());
-                    m_fn(path);
+                    w.fn(path);
                 }
             }
         };
@@ -81,8 +102,9 @@ void Watcher::RunWatcher () {
                 inotify_event* event = (inotify_event*)&buffer[i];
                 if ( event->len ) {
                     handle_event(event);
-                    i += sizeof(inotify_event) + event->len;
                 }
+                // events without a name (IN_IGNORED etc.) must be skipped too
+                i += sizeof(inotify_event) + event->len;
 
             }
         }
@@ -1,25 +1,37 @@
 #pragma once
 
 #include <functional>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 
+// One inotify descriptor shared by all the monitored roots, each watch has its own callback
 class Watcher
 {
 public:
+    typedef std::function< void(const std::string) > callback_fn;
+    // true drops the event before the callback
+    typedef std::function< bool(const std::string& path, bool isDir) > exclude_fn;
+
     Watcher();
     Watcher operator=(const Watcher&) = delete;
     ~Watcher();
 
-    void AddWatch(const std::string& path);
-
-    void SetCallback(const std::function< void(const std::string) > callback);
+    void AddWatch(const std::string& path, callback_fn callback, exclude_fn exclude = nullptr);
+    // the watches of the root and its subdirectories, a running callback is completed before the return
+    void RemoveWatches(const std::string& root);
 
     void RunWatcher ();
 
 private:
 
-    std::function< void(const std::string) > m_fn;
+    struct watch {
+        std::string path;
+        callback_fn fn;
+        exclude_fn exclude;
+    };
+
     int m_fd;
-    std::unordered_map<int, std::string> m_wdDirMap;
+    std::mutex m_mutex;
+    std::unordered_map<int, watch> m_wdDirMap;
 };
@@ -1,10 +1,21 @@
+#include <algorithm>
 #include <boost/program_options.hpp>
+#include <climits>
+#include <cmath>
+#include <filesystem>
+#include <future>
+#include <sstream>
 #include <sys/inotify.h>
 #include <syslog.h>
 
+#include "app/concurrency_tuner.h"
+#include "app/control_server.h"
 #include "app/dir_scanner.h"
+#include "app/path_filter.h"
 #include "app/periodic_task.h"
 #include "app/signal_handlers.h"
+#include "app/snapshot.h"
+#include "app/trace.h"
 
 namespace po = boost::program_options;
 
@@ -61,6 +72,186 @@ namespace {
         else
             return std::string(val);
     }
+
+    // settings of a monitored root,
+    // "path[,period=N][,shards=N][,read_order=dir|inode|extent][,queue=N][,append_only=0|1][,exclude=RULE]...[,exclude_from=FILE]"
+    struct root_config {
+        std::string directory;
+        int period;
+        int shards;
+        std::string read_order;
+        int queue;
+        bool append_only;
+        // appended to the global rules, so they may re-include
+        std::vector<std::string> exclude;
+        std::string exclude_from;
+    };
+
+    root_config parse_root(const std::string& spec, const root_config& defaults)
+    {
+        root_config config = defaults;
+        std::stringstream ss(spec);
+        std::string item;
+        std::getline(ss, config.directory, ',');
+        while (std::getline(ss, item, ',')) {
+            const size_t pos = item.find('=');
+            const std::string key = item.substr(0, pos);
+            const std::string value = pos == std::string::npos ? std::string() : item.substr(pos + 1);
+            if (key == "period")
+                config.period = std::atoi(value.c_str());
+            else if (key == "shards")
+                config.shards = std::atoi(value.c_str());
+            else if (key == "read_order")
+                config.read_order = value;
+            else if (key == "queue")
+                config.queue = std::atoi(value.c_str());
+            else if (key == "append_only")
+                config.append_only = value != "0";
+            else if (key == "exclude")
+                config.exclude.push_back(value);
+            else if (key == "exclude_from")
+                config.exclude_from = value;
+            else
+                throw std::runtime_error(string::format("unknown option \"%s\" of %s", key.c_str(), config.directory.c_str()));
+        }
+        if (config.directory.empty() || config.period <= 0 || config.shards <= 0 || config.queue <= 0) {
+            throw std::runtime_error("invalid directory settings " + spec);
+        }
+        return config;
+    }
+
+    DirScanner::read_order parse_read_order(const std::string& read_order)
+    {
+        if (read_order == "dir")
+            return DirScanner::read_order::DIRECTORY;
+        if (read_order == "inode")
+            return DirScanner::read_order::INODE;
+        if (read_order == "extent")
+            return DirScanner::read_order::EXTENT;
+        throw std::runtime_error("unknown read order " + read_order);
+    }
+
+    // the root which contains the path
+    DirScanner* find_root(const std::vector<DirScanner*>& roots, const std::string& path)
+    {
+        const std::filesystem::path p = std::filesystem::absolute(path).lexically_normal();
+        for (auto* root : roots) {
+            auto rel = p.lexically_relative(root->Directory());
+            if (!rel.empty() && *rel.begin() != "..") {
+                return root;
+            }
+        }
+        return nullptr;
+    }
+
+    bool overlap(const std::filesystem::path& lhs, const std::filesystem::path& rhs)
+    {
+        auto nested = [](const std::filesystem::path& dir, const std::filesystem::path& path)
+        {
+            auto rel = path.lexically_relative(dir);
+            return !rel.empty() && *rel.begin() != "..";
+        };
+        return nested(lhs, rhs) || nested(rhs, lhs);
+    }
+
+    // control socket commands: VERIFY <path>, STATUS <path>, CHANGED, CANCEL, PROGRESS, TRACE ON [sampling] | OFF | DUMP <file>
+    // schedules[i] is the periodic task of roots[i]
+    void handle_request(const std::vector<DirScanner*>& roots, const std::vector<PeriodicTask*>& schedules,
+                        const std::string& request, ControlServer::reply_fn reply)
+    {
+        const size_t pos = request.find(' ');
+        const std::string command = request.substr(0, pos);
+        const std::string arg = pos == std::string::npos ? std::string() : request.substr(pos + 1);
+
+        if ((command == "VERIFY" || command == "STATUS") && !arg.empty()) {
+            DirScanner* root = find_root(roots, arg);
+            if (!root) {
+                reply(string::format("{ \"path\": \"%s\", \"error\": \"not monitored\"}", string::escape_json(arg).c_str()));
+            }
+            else if (command == "VERIFY") {
+                root->Verify(arg, reply);
+            }
+            else {
+                reply(root->Status(arg));
+            }
+        }
+        else if (command == "CHANGED") {
+            // merged arrays of all the roots
+            std::string changed;
+            for (auto* root : roots) {
+                std::string entries = root->Changed();
+                entries = entries.substr(1, entries.size() - 2);
+                if (entries.find('{') == std::string::npos)
+                    continue;
+                changed += changed.empty() ? entries : "," + entries;
+            }
+            changed = "[" + changed + "]";
+            // single line response
+            std::replace(changed.begin(), changed.end(), '\n', ' ');
+            reply(changed);
+        }
+        else if (command == "PROGRESS") {
+            std::string progress;
+            for (size_t i = 0; i < roots.size(); ++i) {
+                const std::string entry = roots[i]->Progress(schedules[i]->NextRun());
+                progress += progress.empty() ? entry : ", " + entry;
+            }
+            reply("[" + progress + "]");
+        }
+        else if (command == "CANCEL") {
+            for (auto* root : roots) {
+                root->Cancel();
+            }
+            reply("{ \"status\": \"OK\"}");
+        }
+        else if (command == "TRACE" && (arg == "ON" || arg.rfind("ON ", 0) == 0)) {
+            // the sampling is one of N, a positive number
+            char* end = nullptr;
+            const long sampling = arg.size() > 3 ? std::strtol(arg.c_str() + 3, &end, 10) : 1;
+            if (sampling < 1 || sampling > UINT_MAX || (end && (end == arg.c_str() + 3 || *end))) {
+                reply(string::format("{ \"error\": \"invalid sampling: %s\"}", string::escape_json(arg.substr(3)).c_str()));
+            }
+            else {
+                trace::Enable((unsigned)sampling);
+                reply("{ \"status\": \"OK\"}");
+            }
+        }
+        else if (command == "TRACE" && arg == "OFF") {
+            trace::Disable();
+            reply("{ \"status\": \"OK\"}");
+        }
+        else if (command == "TRACE" && arg.rfind("DUMP ", 0) == 0) {
+            try {
+                trace::Dump(arg.substr(5));
+                reply("{ \"status\": \"OK\"}");
+            }
+            catch (const std::exception& e) {
+                reply(string::format("{ \"error\": \"%s\"}", string::escape_json(e.what()).c_str()));
+            }
+        }
+        else {
+            reply(string::format("{ \"error\": \"unknown request: %s\"}", string::escape_json(request).c_str()));
+        }
+    }
+
+    // offline diff of two Save() exports, both are parsed and sorted in parallel
+    int compare_snapshots(const std::string& before, const std::string& after)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        auto load = [](const std::string& filename) { return std::make_unique<Snapshot>(filename); };
+        auto beforeFuture = std::async(std::launch::async, load, before);
+        auto afterFuture = std::async(std::launch::async, load, after);
+        auto beforeSnapshot = beforeFuture.get();
+        auto afterSnapshot = afterFuture.get();
+        Snapshot::Sort(*beforeSnapshot, *afterSnapshot);
+
+        auto stats = Snapshot::Compare(*beforeSnapshot, *afterSnapshot, stdout);
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        std::cerr << string::format("%zu -> %zu entries: added %zu, removed %zu, changed %zu in %lld ms",
+            beforeSnapshot->Entries().size(), afterSnapshot->Entries().size(), stats.added, stats.removed, stats.changed,
+            (long long)elapsed.count()) << std::endl;
+        return stats.added || stats.removed || stats.changed ? 3 : 0;
+    }
 }
 
 
@@ -69,17 +260,41 @@ namespace {
 int main(int argc, char** argv) {
     stacktrace::registerHandlers();
 
-    std::string directory;
-    int worker_threads, period, queue_size; // TODO too small period for a large dir queue management?
+    std::vector<std::string> directories, exclude, compare;
+    std::string read_order, socket_path, exclude_from;
+    long long min_size, max_size, min_age, max_age;
+    int worker_threads, tune_period, period, queue_size, shards, io_limit, trace_sampling; // TODO too small period for a large dir queue management?
+    PeriodicTask::Schedule schedule;
 
     po::options_description desc("Program options");
     desc.add_options()
         ("help,h", "Show help")
         ("daemonize,d", "daemonize")
-        ("dir,D", po::value< std::string >(&directory)->default_value(""), "The directory to monitore, may be setted by CRC_SCAN_DIRECTORY environment variable")
-        ("worker_threads,T", po::value< int >( &worker_threads )->default_value(0), "Number of worker threads used for crc check, 0 - auto")
-        ("queue,Q", po::value< int >(&queue_size)->default_value(1000000), "Size of files queue")
-        ("period,P", po::value< int >( &period )->default_value(0), "Recalculating period in seconds, may be setted by CRC_SCAN_DIRECTORY_PERIOD environment variable");
+        ("compare", po::value< std::vector<std::string> >(&compare)->multitoken(), "Compare two result.json exports: --compare OLD NEW, prints the added, removed and changed entries and exits, "
+            "the exit code is 3 if they differ")
+        ("immediate_start", "Watch the changes immediately and build the baseline in the background")
+        ("append_only", "Accept the grown files with the intact prefix, only the appended tail is hashed")
+        ("dir,D", po::value< std::vector<std::string> >(&directories)->composing(), "The directory to monitore, may be repeated, may be setted by CRC_SCAN_DIRECTORY environment variable. "
+            "Per directory settings: path[,period=N][,shards=N][,read_order=X][,queue=N][,append_only=0|1][,exclude=RULE]...[,exclude_from=FILE]")
+        ("worker_threads,T", po::value< int >( &worker_threads )->default_value(0), "Number of worker threads used for crc check, 0 - auto: limited by the cgroup CPU quota and tuned by the read throughput")
+        ("tune_period", po::value< int >( &tune_period )->default_value(5), "Seconds between the worker threads adjustments in the auto mode, 0 - disabled")
+        ("queue,Q", po::value< int >(&queue_size)->default_value(1000000), "Size of files queue, shared by all the directories, each of them queues an equal part by default")
+        ("period,P", po::value< int >( &period )->default_value(0), "Recalculating period in seconds, may be setted by CRC_SCAN_DIRECTORY_PERIOD environment variable")
+        ("shards,S", po::value< int >( &shards )->default_value(1), "Number of shards for the rolling check, one shard is verified per period, 1 - full scan each period")
+        ("read_order,O", po::value< std::string >(&read_order)->default_value("inode"), "Files read order: dir, inode or extent (physical layout from FIEMAP)")
+        ("duty_cycle", po::value< double >( &schedule.dutyCycle )->default_value(0), "Max share of wall time spent in scanning, the period adapts to the scan duration, 0 - fixed period")
+        ("min_period", po::value< int >( &schedule.minPeriod )->default_value(0), "Min adaptive period in seconds, 0 - unbounded")
+        ("max_period", po::value< int >( &schedule.maxPeriod )->default_value(0), "Max adaptive period in seconds, 0 - unbounded")
+        ("jitter", po::value< double >( &schedule.jitter )->default_value(0), "Random shift of each scan start, share of the period")
+        ("exclude,E", po::value< std::vector<std::string> >(&exclude)->composing(), "gitignore-style rule relative to the directory, may be repeated, the last matching rule wins, '!' re-includes")
+        ("exclude_from", po::value< std::string >(&exclude_from)->default_value(""), "File of the gitignore-style rules, applied before --exclude")
+        ("min_size", po::value< long long >( &min_size )->default_value(0), "Skip the files smaller than N bytes")
+        ("max_size", po::value< long long >( &max_size )->default_value(0), "Skip the files larger than N bytes, 0 - unlimited")
+        ("min_age", po::value< long long >( &min_age )->default_value(0), "Skip the files modified less than N seconds ago")
+        ("max_age", po::value< long long >( &max_age )->default_value(0), "Skip the files modified more than N seconds ago, 0 - unlimited")
+        ("socket", po::value< std::string >(&socket_path)->default_value(""), "Unix socket of the control API, disabled if empty")
+        ("io_limit", po::value< int >( &io_limit )->default_value(0), "Read bandwidth in MB/s shared by all the directories, 0 - unlimited")
+        ("trace", po::value< int >( &trace_sampling )->default_value(0), "Record one of N scans and tasks into the trace buffers, 0 - disabled, may be toggled by the control API");
 
 
     try
@@ -94,6 +309,13 @@ int main(int argc, char** argv) {
             return 0;
         }
 
+        if (!compare.empty()) {
+            if (compare.size() != 2) {
+                throw std::runtime_error("--compare takes two files");
+            }
+            return compare_snapshots(compare[0], compare[1]);
+        }
+
         if (vm.count("daemonize")) {
              // daemon(nochdir, noclose)
             if( daemon(1, 0) != 0 ) {
@@ -102,11 +324,12 @@ int main(int argc, char** argv) {
             }
         }
 
-        if (directory.empty()) {
-            directory = get_env("CRC_SCAN_DIRECTORY");
+        if (directories.empty()) {
+            std::string directory = get_env("CRC_SCAN_DIRECTORY");
             if (directory.empty()) {
                 throw std::runtime_error("directory is not specified");
             }
+            directories.push_back(directory);
         }
 
         if (period == 0) {
@@ -118,37 +341,163 @@ int main(int argc, char** argv) {
             }
         }
 
-        if (worker_threads == 0) {
-            worker_threads = std::max((unsigned int)1, (unsigned int)std::thread::hardware_concurrency());
+        // auto mode: starts with the CPU count, the I/O waits may be covered by up to twice as many workers
+        int active_threads = worker_threads;
+        const bool auto_threads = worker_threads == 0;
+        if (auto_threads) {
+            active_threads = std::max((unsigned int)1, (unsigned int)std::thread::hardware_concurrency());
+            const double cpus = ConcurrencyTuner::CpuLimit();
+            if (cpus > 0) {
+                active_threads = std::max(1, std::min(active_threads, (int)std::ceil(cpus)));
+            }
+            worker_threads = active_threads * 2;
+            syslog(LOG_INFO, "Worker threads: %d of %d, cgroup CPU limit %.2f", active_threads, worker_threads, cpus);
+        }
+
+        if (schedule.dutyCycle < 0 || schedule.dutyCycle > 1 || schedule.jitter < 0 || schedule.jitter >= 1) {
+            throw std::runtime_error("duty_cycle must be in [0, 1] and jitter in [0, 1)");
+        }
+
+        if (trace_sampling < 0) {
+            throw std::runtime_error("trace sampling must not be negative");
+        }
+        if (trace_sampling > 0) {
+            trace::Enable(trace_sampling);
+        }
+
+        // all the directories share the workers, the inotify descriptor and the read bandwidth
+        auto workers = std::make_shared<ThreadPool>(worker_threads, queue_size, active_threads);
+        auto watcher = std::make_shared<Watcher>();
+        auto budget = std::make_shared<IoBudget>((uint64_t)std::max(0, io_limit) * 1024 * 1024);
+
+        // started before the baseline, so the first scan is tuned too
+        std::unique_ptr<ConcurrencyTuner> tuner;
+        std::unique_ptr<PeriodicTask> tuneTask;
+        if (auto_threads && tune_period > 0) {
+            tuner.reset(new ConcurrencyTuner(workers, budget));
+            tuneTask.reset(new PeriodicTask(tune_period, std::bind(&ConcurrencyTuner::Step, tuner.get())));
+        }
+
+        if (min_size < 0 || max_size < 0 || min_age < 0 || max_age < 0) {
+            throw std::runtime_error("size and age limits must not be negative");
+        }
+
+        // the rules are compiled once and copied to each directory with its own rules appended
+        PathFilter filter;
+        if (!exclude_from.empty()) {
+            filter.AddRulesFile(exclude_from);
+        }
+        for (const auto& rule : exclude) {
+            filter.AddRule(rule);
         }
+        filter.SetSizeLimits(min_size, max_size);
+        filter.SetAgeLimits(min_age, max_age);
 
+        // the roots share the queue lanes, each of them gets an equal part by default
+        const int root_queue = std::max(1, queue_size / (int)directories.size());
+        const root_config defaults{ std::string(), period, shards, read_order, root_queue, vm.count("append_only") != 0, {}, std::string() };
+        std::vector<std::unique_ptr<DirScanner>> apps;
+        std::vector<DirScanner*> roots;
+        std::vector<root_config> configs;
+        for (const auto& spec : directories) {
+            configs.push_back(parse_root(spec, defaults));
+            const root_config& config = configs.back();
 
-        auto app = std::make_unique<DirScanner>(directory, worker_threads, queue_size);
-        app->Scan(true);
-        app->RunWatcher();
+            apps.push_back(std::make_unique<DirScanner>(config.directory, workers, watcher, budget, config.queue));
+            // a directory has a single inotify watch, so it can't belong to two roots
+            for (size_t i = 0; i + 1 < apps.size(); ++i) {
+                if (overlap(apps[i]->Directory(), apps.back()->Directory())) {
+                    throw std::runtime_error(string::format("directories %s and %s overlap",
+                        apps[i]->Directory().c_str(), apps.back()->Directory().c_str()));
+                }
+            }
+            apps.back()->SetReadOrder(parse_read_order(config.read_order));
+            apps.back()->SetAppendOnly(config.append_only);
+            PathFilter rootFilter = filter;
+            if (!config.exclude_from.empty()) {
+                rootFilter.AddRulesFile(config.exclude_from);
+            }
+            for (const auto& rule : config.exclude) {
+                rootFilter.AddRule(rule);
+            }
+            apps.back()->SetFilter(rootFilter);
+            roots.push_back(apps.back().get());
+        }
 
-        PeriodicTask crcUpdateTask(period, std::bind(&DirScanner::Scan, app.get(), false));
+        if (vm.count("immediate_start")) {
+            for (auto& app : apps) {
+                app->WatchTree();
+            }
+            watcher->RunWatcher();
+            for (auto& app : apps) {
+                app->StartBaseline();
+            }
+        }
+        else {
+            for (auto& app : apps) {
+                app->Scan(true);
+            }
+            watcher->RunWatcher();
+        }
+
+        std::vector<std::unique_ptr<PeriodicTask>> crcUpdateTasks;
+        std::vector<PeriodicTask*> schedules;
+        for (size_t i = 0; i < apps.size(); ++i) {
+            DirScanner* app = apps[i].get();
+            std::function<void()> periodicAction = std::bind(&DirScanner::Scan, app, false);
+            if (configs[i].shards > 1) {
+                app->SetShards(configs[i].shards);
+                periodicAction = std::bind(&DirScanner::ScanNextShard, app);
+            }
+            crcUpdateTasks.emplace_back(new PeriodicTask(configs[i].period, schedule, periodicAction,
+                std::bind(&DirScanner::ReadBytes, app)));
+            schedules.push_back(crcUpdateTasks.back().get());
+        }
+
+        // PROGRESS reports the planned scans, so the server starts after them
+        std::unique_ptr<ControlServer> controlServer;
+        if (!socket_path.empty()) {
+            controlServer.reset(new ControlServer(socket_path,
+                std::bind(handle_request, roots, schedules, std::placeholders::_1, std::placeholders::_2)));
+        }
 
         bool sStop = false;
         do {
-            pause();
-
-            switch (stacktrace::g_signal)
+            switch (stacktrace::waitSignal())
             {
                 case SIGTERM:
                     // stopping the application
                     sStop = true;
                     break;
                 case SIGUSR1:
-                    app->Scan();
+                    for (auto& app : apps) {
+                        app->Scan();
+                    }
                     break;
                 case SIGUSR2:
-                    app->Save("result.json");
+                    if (apps.size() == 1) {
+                        apps.front()->Save("result.json");
+                        apps.front()->SaveChanged("changed.json");
+                        break;
+                    }
+                    for (size_t i = 0; i < apps.size(); ++i) {
+                        apps[i]->Save(string::format("result_%zu.json", i));
+                        apps[i]->SaveChanged(string::format("changed_%zu.json", i));
+                    }
                     break;
                 default:
                     break;
             }
         } while(!sStop);
+
+        // the roots wait for their queued tasks, the VERIFY ones still reply to the stopped control server
+        if (controlServer) {
+            controlServer->Stop();
+        }
+        crcUpdateTasks.clear();
+        tuneTask.reset();
+        apps.clear();
+        controlServer.reset();
     }
     catch(const std::exception &e)
     {